@@ -0,0 +1,137 @@
+/* Copyright 2022 Josias Allestad <me@josias.dev> and Jacob <zathaxx@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Memory for a single frame, and counting what the heap is asked for.
+#ifndef TETRIS_ARENA_H
+#define TETRIS_ARENA_H
+
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+// The allocations made by the current thread since it started: every operator new and
+// every SDL_malloc, both of which main.cpp routes through here.
+struct Allocations {
+	uint64_t count;
+	uint64_t bytes;
+};
+
+inline thread_local Allocations allocations = {0, 0};
+
+inline void *counted_malloc(size_t size)
+{
+	allocations.count += 1;
+	allocations.bytes += size;
+	return std::malloc(size);
+}
+
+inline void *counted_calloc(size_t count, size_t size)
+{
+	allocations.count += 1;
+	allocations.bytes += count * size;
+	return std::calloc(count, size);
+}
+
+inline void *counted_realloc(void *memory, size_t size)
+{
+	allocations.count += 1;
+	allocations.bytes += size;
+	return std::realloc(memory, size);
+}
+
+// A bump allocator for things that are thrown away at the end of the frame, like the
+// strings drawn on screen. Allocating is moving a pointer, and reset() frees everything
+// at once. If a frame ever needs more than the arena holds, the rest comes from the heap
+// and is given back on reset().
+class FrameArena
+{
+      public:
+	static const size_t capacity = 64 * 1024;
+
+	// The most the arena has had to hold in one frame
+	size_t high_water = 0;
+
+	FrameArena() = default;
+	FrameArena(const FrameArena &) = delete;
+	FrameArena &operator=(const FrameArena &) = delete;
+
+	~FrameArena() { this->reset(); }
+
+	void *allocate(size_t size, size_t align = alignof(std::max_align_t))
+	{
+		size_t offset = (this->used + align - 1) & ~(align - 1);
+		if (offset + size <= capacity) {
+			this->used = offset + size;
+			return this->buffer + offset;
+		}
+
+		// Out of room: chain a block from the heap onto the overflow list
+		auto *block = static_cast<Overflow *>(
+		    counted_malloc(sizeof(Overflow) + size + alignof(std::max_align_t)));
+		if (!block) {
+			throw std::bad_alloc();
+		}
+		block->next = this->overflow;
+		this->overflow = block;
+		this->overflow_bytes += size;
+		return reinterpret_cast<char *>(block + 1);
+	}
+
+	// printf into the arena
+	const char *format(const char *format, ...) __attribute__((format(printf, 2, 3)))
+	{
+		va_list args;
+		va_start(args, format);
+		va_list copy;
+		va_copy(copy, args);
+		int length = std::vsnprintf(nullptr, 0, format, copy);
+		va_end(copy);
+
+		auto *text = static_cast<char *>(this->allocate(length + 1, 1));
+		std::vsnprintf(text, length + 1, format, args);
+		va_end(args);
+		return text;
+	}
+
+	void reset()
+	{
+		if (this->used + this->overflow_bytes > this->high_water) {
+			this->high_water = this->used + this->overflow_bytes;
+		}
+		while (this->overflow) {
+			auto *next = this->overflow->next;
+			std::free(this->overflow);
+			this->overflow = next;
+		}
+		this->used = 0;
+		this->overflow_bytes = 0;
+	}
+
+      private:
+	struct Overflow {
+		Overflow *next;
+		alignas(std::max_align_t) char padding[1];
+	};
+
+	alignas(std::max_align_t) char buffer[capacity];
+	size_t used = 0;
+	Overflow *overflow = nullptr;
+	size_t overflow_bytes = 0;
+};
+
+#endif
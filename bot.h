@@ -0,0 +1,139 @@
+/* Copyright 2022 Josias Allestad <me@josias.dev> and Jacob <zathaxx@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* The bot plugin interface.
+ *
+ * A bot is a shared object exporting the functions declared at the bottom of this file.
+ * It is loaded with `./TETRIS --bot path.so` (or `--headless --bot path.so`).
+ *
+ * The game hands the bot a read-only view of its state. The view points into a copy of
+ * the board kept for the bot, which is reused from call to call. The view is only valid
+ * for the duration of tetris_bot_think(); don't keep pointers to it.
+ *
+ * Every call has a deadline (--bot-timeout, in milliseconds). A bot that misses it loses
+ * its turn and the piece is dropped where it is, without waiting for the call to return.
+ * The game keeps running meanwhile, and the bot isn't asked about another piece until the
+ * late call has returned. */
+#ifndef TETRIS_BOT_H
+#define TETRIS_BOT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bumped whenever any of the structures below change layout */
+#define TETRIS_BOT_ABI_VERSION 2
+
+/* Bots are only offered boards up to this many columns wide. On a wider board the bot is
+ * never asked, and every piece is dropped where it spawns. */
+#define TETRIS_BOT_MAX_WIDTH 64
+
+/* The most inputs a bot may return for a single piece */
+#define TETRIS_BOT_MAX_INPUTS 64
+
+/* A cell of a tetromino, relative to the tetromino's offset */
+struct tetris_bot_cell {
+	int32_t x;
+	int32_t y;
+};
+
+struct tetris_bot_piece {
+	const struct tetris_bot_cell *cells;
+	int32_t cell_count;
+
+	/* Added to every cell to get its position on the board */
+	int32_t offset_x;
+	int32_t offset_y;
+};
+
+/* The first step of a way to clear the board completely using only the tetrominos the game
+ * already knows about, found by the game before asking the bot. `pieces` is how many
+ * tetrominos the clear takes, counting the falling one, or 0 if none was found in time.
+ * Place the falling tetromino as a TETRIS_BOT_PLACEMENT with `rotations` and `x` to follow
+ * it; the next call has the step after. */
+struct tetris_bot_perfect_clear {
+	int32_t pieces;
+	int32_t rotations;
+	int32_t x;
+};
+
+struct tetris_bot_state {
+	int32_t width;
+	int32_t height;
+
+	/* One entry per row, top row first. Bit x of rows[y] is set when (x, y) is filled. */
+	const uint64_t *rows;
+
+	/* The falling tetromino and the one after it */
+	struct tetris_bot_piece current;
+	struct tetris_bot_piece preview;
+
+	int32_t score;
+	int32_t level;
+
+	/* Milliseconds the bot has before its answer is thrown away */
+	uint32_t timeout;
+
+	struct tetris_bot_perfect_clear perfect_clear;
+};
+
+enum tetris_bot_move_kind {
+	/* Rotate `rotations` times, move until the leftmost cell is in column `x`, then drop */
+	TETRIS_BOT_PLACEMENT = 0,
+	/* Press `inputs` in order */
+	TETRIS_BOT_INPUTS = 1,
+};
+
+enum tetris_bot_input {
+	TETRIS_BOT_LEFT = 'L',
+	TETRIS_BOT_RIGHT = 'R',
+	TETRIS_BOT_DOWN = 'D',
+	TETRIS_BOT_ROTATE = 'U',
+	TETRIS_BOT_DROP = ' ',
+};
+
+struct tetris_bot_move {
+	int32_t kind;
+
+	/* TETRIS_BOT_PLACEMENT */
+	int32_t rotations;
+	int32_t x;
+
+	/* TETRIS_BOT_INPUTS */
+	int32_t input_count;
+	uint8_t inputs[TETRIS_BOT_MAX_INPUTS];
+};
+
+/* Must return TETRIS_BOT_ABI_VERSION. Plugins built against another version aren't loaded. */
+int32_t tetris_bot_abi_version(void);
+
+/* Optional. Creates per-board bot state, passed back to every other call. */
+void *tetris_bot_create(void);
+
+/* Fills in `move` for the current piece. Returns 0 on success; anything else forfeits the
+ * turn. Called from a worker thread, one call at a time per board. */
+int32_t tetris_bot_think(void *bot, const struct tetris_bot_state *state,
+			struct tetris_bot_move *move);
+
+/* Optional. Frees whatever tetris_bot_create returned. */
+void tetris_bot_destroy(void *bot);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,83 @@
+/* Copyright 2022 Josias Allestad <me@josias.dev> and Jacob <zathaxx@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* The simplest useful bot: follows the game's perfect clear when there is one, and
+ * otherwise drops each piece unrotated in the column where it comes to rest lowest. A
+ * starting point for writing a real one.
+ *
+ *	$ make bots
+ *	$ ./TETRIS --bot bots/example.so */
+#include "../bot.h"
+
+int32_t tetris_bot_abi_version(void) { return TETRIS_BOT_ABI_VERSION; }
+
+static int fits(const struct tetris_bot_state *state, int x, int y)
+{
+	for (int i = 0; i < state->current.cell_count; ++i) {
+		int cx = state->current.cells[i].x + x;
+		int cy = state->current.cells[i].y + y;
+		if (cx < 0 || cx >= state->width || cy >= state->height) {
+			return 0;
+		}
+		if (cy >= 0 && (state->rows[cy] >> cx) & 1) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int32_t tetris_bot_think(void *bot, const struct tetris_bot_state *state,
+			 struct tetris_bot_move *move)
+{
+	(void)bot;
+
+	if (state->perfect_clear.pieces > 0) {
+		move->kind = TETRIS_BOT_PLACEMENT;
+		move->rotations = state->perfect_clear.rotations;
+		move->x = state->perfect_clear.x;
+		return 0;
+	}
+
+	int min_x = state->current.cells[0].x;
+	for (int i = 1; i < state->current.cell_count; ++i) {
+		if (state->current.cells[i].x < min_x) {
+			min_x = state->current.cells[i].x;
+		}
+	}
+
+	int best_x = -1;
+	int best_y = -1;
+	for (int x = -min_x; x < state->width; ++x) {
+		int y = state->current.offset_y;
+		if (!fits(state, x, y)) {
+			continue;
+		}
+		while (fits(state, x, y + 1)) {
+			y += 1;
+		}
+		if (y > best_y) {
+			best_y = y;
+			best_x = x;
+		}
+	}
+	if (best_x < 0) {
+		return 1;
+	}
+
+	move->kind = TETRIS_BOT_PLACEMENT;
+	move->rotations = 0;
+	move->x = best_x + min_x;
+	return 0;
+}
@@ -0,0 +1,91 @@
+/* Copyright 2022 Josias Allestad <me@josias.dev> and Jacob <zathaxx@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Every asset packed into one file (assets.bundle), so starting up means mapping a single
+// file instead of opening and reading each asset in turn. `make` builds it with pack.
+//
+// The file is a BundleHeader, then `count` BundleEntries, then the assets themselves, each
+// starting on a 16 byte boundary. Assets are stored exactly as they are in assets/.
+#ifndef TETRIS_BUNDLE_H
+#define TETRIS_BUNDLE_H
+
+#include <cstdint>
+#include <cstring>
+
+#include "mapped.h"
+
+const char bundle_magic[8] = {'T', 'E', 'T', 'R', 'I', 'S', 'A', '1'};
+
+struct BundleHeader {
+	char magic[8];
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct BundleEntry {
+	// The file name within assets/, zero padded
+	char name[48];
+	uint64_t offset;
+	uint64_t size;
+};
+
+class Bundle
+{
+      public:
+	// False if there is no bundle at `path`, or it isn't one
+	bool open(const char *path)
+	{
+		if (!this->file.open(path) || this->file.size < sizeof(BundleHeader)) {
+			this->file.close();
+			return false;
+		}
+		std::memcpy(&this->header, this->file.data, sizeof(this->header));
+		if (std::memcmp(this->header.magic, bundle_magic, sizeof(bundle_magic)) != 0 ||
+		    sizeof(BundleHeader) + uint64_t(this->header.count) * sizeof(BundleEntry) >
+			this->file.size) {
+			this->file.close();
+			return false;
+		}
+		return true;
+	}
+
+	bool is_open() const { return this->file.data != nullptr; }
+
+	// Finds the asset called `name`. Its bytes stay valid for as long as the bundle is open.
+	bool find(const char *name, const char *&data, size_t &size) const
+	{
+		if (!this->is_open()) {
+			return false;
+		}
+		auto *entries =
+		    reinterpret_cast<const BundleEntry *>(this->file.data + sizeof(BundleHeader));
+		for (uint32_t i = 0; i < this->header.count; ++i) {
+			auto &entry = entries[i];
+			if (std::strncmp(entry.name, name, sizeof(entry.name)) == 0 &&
+			    entry.offset + entry.size <= this->file.size) {
+				data = this->file.data + entry.offset;
+				size = entry.size;
+				return true;
+			}
+		}
+		return false;
+	}
+
+      private:
+	MappedFile file;
+	BundleHeader header = {};
+};
+
+#endif
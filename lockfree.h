@@ -0,0 +1,216 @@
+/* Copyright 2022 Josias Allestad <me@josias.dev> and Jacob <zathaxx@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Ways of handing data from one thread to others without any of them waiting.
+#ifndef TETRIS_LOCKFREE_H
+#define TETRIS_LOCKFREE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// A fixed-size queue for exactly one producer thread and one consumer thread.
+// push() fails rather than waiting when the queue is full.
+template <typename T, size_t Capacity> class SpscQueue
+{
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+      public:
+	bool push(const T &item)
+	{
+		auto tail = this->tail.load(std::memory_order_relaxed);
+		if (tail - this->head.load(std::memory_order_acquire) == Capacity) {
+			return false;
+		}
+		this->items[tail % Capacity] = item;
+		this->tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T &item)
+	{
+		auto head = this->head.load(std::memory_order_relaxed);
+		if (head == this->tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		item = this->items[head % Capacity];
+		this->head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+      private:
+	T items[Capacity] = {};
+
+	// Kept on separate cache lines, since each is written by a different thread
+	alignas(64) std::atomic<size_t> head{0};
+	alignas(64) std::atomic<size_t> tail{0};
+};
+
+// Hands the newest version of a value from one writer thread to one reader thread.
+// The writer fills in write(), then publish()es it; the reader calls update() and then
+// looks at read(), which stays the same until the next update(). There are three copies,
+// so neither side ever waits for the other: the writer always has one to itself, the
+// reader has one, and the third holds the newest published version.
+// Older versions the reader never got to are simply skipped.
+template <typename T> class TripleBuffer
+{
+      public:
+	T &write() { return this->slots[this->back]; }
+
+	void publish()
+	{
+		this->back = this->middle.exchange(this->back | fresh, std::memory_order_acq_rel) &
+			     index;
+	}
+
+	// Swaps in the newest published version. False if there is none since the last call.
+	bool update()
+	{
+		if (!(this->middle.load(std::memory_order_relaxed) & fresh)) {
+			return false;
+		}
+		this->front = this->middle.exchange(this->front, std::memory_order_acq_rel) & index;
+		return true;
+	}
+
+	T &read() { return this->slots[this->front]; }
+
+      private:
+	static const uint8_t index = 3;
+	static const uint8_t fresh = 4;
+
+	T slots[3];
+
+	// The writer's, the reader's, and the one in between with a bit for whether it is
+	// newer than the reader's
+	uint8_t back = 0;
+	uint8_t front = 1;
+	alignas(64) std::atomic<uint8_t> middle{2};
+};
+
+// Hands every item from one writer thread to any number of readers, each reading at its
+// own pace. The writer never waits: once the ring is full it writes over the oldest item,
+// and a reader that fell that far behind skips ahead to the oldest item still there,
+// counting how many it missed.
+//
+// Each slot carries the sequence number of the item in it, odd while it is being written
+// and even once it is done. A reader copies the item out and then checks the number again,
+// so an item that was overwritten while being copied is noticed and thrown away.
+template <typename T, size_t Capacity> class BroadcastRing
+{
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+	static_assert(std::is_trivially_copyable<T>::value, "Items are copied as raw words");
+
+	static const size_t words = (sizeof(T) + 7) / 8;
+
+	struct alignas(64) Slot {
+		std::atomic<uint64_t> sequence{0};
+		// The item, as words so that a reader copying it while it is being written over
+		// is well defined. The reader finds out afterwards and doesn't use the copy.
+		std::atomic<uint64_t> data[words] = {};
+	};
+
+      public:
+	// Reads the items pushed from when it was made (see subscribe())
+	class Reader
+	{
+	      public:
+		// How many items were written over before this reader got to them
+		uint64_t missed = 0;
+
+		// The next item, or false if there is none yet
+		bool next(T &item)
+		{
+			for (;;) {
+				uint64_t head = this->ring->head.load(std::memory_order_acquire);
+				if (this->cursor == head) {
+					return false;
+				}
+				if (head - this->cursor > Capacity) {
+					this->skip(head - Capacity);
+					continue;
+				}
+				auto &slot = this->ring->slots[this->cursor % Capacity];
+				uint64_t done = this->cursor * 2 + 2;
+				if (slot.sequence.load(std::memory_order_acquire) != done) {
+					// Already being written over
+					this->skip(this->cursor + 1);
+					continue;
+				}
+				uint64_t copy[words];
+				for (size_t i = 0; i < words; ++i) {
+					copy[i] = slot.data[i].load(std::memory_order_relaxed);
+				}
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (slot.sequence.load(std::memory_order_relaxed) != done) {
+					this->skip(this->cursor + 1);
+					continue;
+				}
+				std::memcpy(&item, copy, sizeof(T));
+				this->cursor += 1;
+				return true;
+			}
+		}
+
+	      private:
+		friend class BroadcastRing;
+
+		const BroadcastRing *ring;
+		uint64_t cursor;
+
+		Reader(const BroadcastRing *ring, uint64_t cursor) : ring(ring), cursor(cursor) {}
+
+		void skip(uint64_t to)
+		{
+			this->missed += to - this->cursor;
+			this->cursor = to;
+		}
+	};
+
+	// Only ever called from the writer's thread
+	void push(const T &item)
+	{
+		uint64_t sequence = this->head.load(std::memory_order_relaxed);
+		auto &slot = this->slots[sequence % Capacity];
+		uint64_t copy[words] = {};
+		std::memcpy(copy, &item, sizeof(T));
+
+		slot.sequence.store(sequence * 2 + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (size_t i = 0; i < words; ++i) {
+			slot.data[i].store(copy[i], std::memory_order_relaxed);
+		}
+		slot.sequence.store(sequence * 2 + 2, std::memory_order_release);
+		this->head.store(sequence + 1, std::memory_order_release);
+	}
+
+	// A reader of everything pushed from now on. Readers can be made from any thread, and
+	// need nothing from the ring to be let go of.
+	Reader subscribe() const
+	{
+		return Reader(this, this->head.load(std::memory_order_acquire));
+	}
+
+	// How many items have been pushed so far
+	uint64_t pushed() const { return this->head.load(std::memory_order_relaxed); }
+
+      private:
+	Slot slots[Capacity];
+	alignas(64) std::atomic<uint64_t> head{0};
+};
+
+#endif
@@ -13,11 +13,24 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>. */
 #include <algorithm>
+#include <cassert>
+#include <atomic>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <initializer_list>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 // I love this library
@@ -26,12 +39,122 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>. */
 #include <SDL2/SDL_mixer.h>
 #include <SDL2/SDL_ttf.h>
 
+#include <dirent.h>
+#include <sys/file.h>
+
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
 #endif
 
+#include "arena.h"
+#include "bot.h"
+#include "bundle.h"
+#include "lockfree.h"
+#include "mapped.h"
+#include "simd.h"
+#include "trace.h"
+
 using std::vector;
 
+// The browser build only has threads when it is built with them
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+#define TETRIS_NO_THREADS
+#endif
+
+// When the program started, as near as can be told
+const auto process_start = std::chrono::steady_clock::now();
+
+double since_start()
+{
+	std::chrono::duration<double, std::milli> elapsed =
+	    std::chrono::steady_clock::now() - process_start;
+	return elapsed.count();
+}
+
+// Something SDL or one of its libraries couldn't do, along with SDL's reason
+class SdlError : public std::runtime_error
+{
+      public:
+	SdlError(const std::string &what) : std::runtime_error(what + ": " + SDL_GetError()) {}
+};
+
+// Where the time goes between starting and being ready to play (--startup-profile).
+// Phases are recorded as they end, from whichever thread ran them, and printed together
+// once the game is up.
+class StartupProfile
+{
+      public:
+	bool enabled = false;
+
+	// `start` and `end` are as given by since_start()
+	void record(const char *name, double start, double end)
+	{
+		if (!this->enabled) {
+			return;
+		}
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->phases.push_back({name, start, end});
+	}
+
+	// Prints the phases so far in the order they started. Phases on other threads overlap
+	// the ones on the main thread, which is the point of running them there.
+	void print()
+	{
+		if (!this->enabled) {
+			return;
+		}
+		std::lock_guard<std::mutex> lock(this->mutex);
+		std::stable_sort(this->phases.begin(), this->phases.end(),
+				 [](const auto &a, const auto &b) { return a.start < b.start; });
+		for (const auto &phase : this->phases) {
+			std::fprintf(stderr, "startup: %-20s %7.1f ms  (%.1f to %.1f)\n", phase.name,
+				     phase.end - phase.start, phase.start, phase.end);
+		}
+		this->phases.clear();
+	}
+
+      private:
+	struct Phase {
+		const char *name;
+		double start;
+		double end;
+	};
+
+	std::mutex mutex;
+	vector<Phase> phases;
+};
+
+StartupProfile startup;
+
+// Records a phase of startup from here to the end of the scope
+class StartupPhase
+{
+      public:
+	StartupPhase(const char *name) : name(name), start(since_start()) {}
+	~StartupPhase() { startup.record(this->name, this->start, since_start()); }
+
+      private:
+	const char *name;
+	double start;
+};
+
+// Every allocation goes through these, so it can be counted (see arena.h).
+// They are kept out of line: once inlined, GCC sees memory from `new` being handed to
+// free() and, optimizing, warns that they don't match (-Wmismatched-new-delete).
+__attribute__((noinline)) void *operator new(size_t size)
+{
+	if (void *memory = counted_malloc(size ? size : 1)) {
+		return memory;
+	}
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *memory) noexcept { std::free(memory); }
+__attribute__((noinline)) void operator delete(void *memory, size_t) noexcept
+{
+	std::free(memory);
+}
+
 struct RGB {
 	int r;
 	int g;
@@ -49,11 +172,48 @@ struct Location {
 	int y;
 };
 
+// The locations of the individual blocks in a tetromino. There are never more than four,
+// so they are kept inline: copying a Block or taking its coordinates never allocates.
+class Cells
+{
+      public:
+	static const size_t capacity = 4;
+
+	Cells() {}
+	Cells(std::initializer_list<Location> locations)
+	{
+		for (const auto &location : locations) {
+			this->push_back(location);
+		}
+	}
+
+	void push_back(Location location)
+	{
+		assert(this->count < capacity);
+		this->cells[this->count++] = location;
+	}
+
+	size_t size() const { return this->count; }
+	Location *data() { return this->cells; }
+	const Location *data() const { return this->cells; }
+	Location &operator[](size_t i) { return this->cells[i]; }
+	const Location &operator[](size_t i) const { return this->cells[i]; }
+
+	Location *begin() { return this->cells; }
+	Location *end() { return this->cells + this->count; }
+	const Location *begin() const { return this->cells; }
+	const Location *end() const { return this->cells + this->count; }
+
+      private:
+	Location cells[capacity] = {};
+	size_t count = 0;
+};
+
 class Block
 {
       public:
 	// The relative locations of individual blocks in a tetromino
-	vector<Location> locations;
+	Cells locations;
 
 	// The current offsets to determine where the tetromino is on the game board.
 	int offset_x = 3;
@@ -65,9 +225,9 @@ class Block
 	Block() {}
 
 	// Calculate the current coordinates by applying the offsets to locations
-	vector<Location> coordinates()
+	Cells coordinates()
 	{
-		vector<Location> new_loc;
+		Cells new_loc;
 		for (const auto &location : locations) {
 			new_loc.push_back({location.x + offset_x, location.y + offset_y});
 		}
@@ -183,7 +343,7 @@ class Block
 
 	bool can_move(int x, int y, vector<FilledBlock> *filled)
 	{
-		vector<Location> block_locations = this->coordinates();
+		auto block_locations = this->coordinates();
 		for (const auto &floc : *filled) {
 			for (const auto &bloc : block_locations) {
 				if (bloc.x + x == floc.x && bloc.y + y == floc.y) {
@@ -203,6 +363,221 @@ class Block
 	}
 };
 
+// The seven tetrominos, and the color each one is drawn in
+const vector<Cells> block_shapes = {
+    // J Shape
+    {{1, 0}, {1, 1}, {1, 2}, {2, 0}},
+    // L Shape
+    {{1, 0}, {1, 1}, {1, 2}, {0, 0}},
+    // O Shope
+    {{0, 0}, {0, 1}, {1, 0}, {1, 1}},
+    // I Shape
+    {{1, 0}, {1, 1}, {1, 2}, {1, 3}},
+    // T shape
+    {{1, 0}, {0, 1}, {1, 1}, {1, 2}},
+    // Z shape
+    {{0, 0}, {1, 0}, {1, 1}, {2, 1}},
+    // S shape
+    {{1, 0}, {2, 0}, {0, 1}, {1, 1}},
+};
+
+const vector<RGB> block_colors = {
+    RGB{255, 0, 0},   RGB{0, 255, 0},  RGB{0, 0, 255},   RGB{255, 255, 0},
+    RGB{0, 255, 255}, RGB{90, 0, 255}, RGB{255, 0, 90},
+};
+
+// Replays: everything needed to play a game over again. A replay file is a ReplayHeader
+// followed by one ReplayEvent per input, in the order they happened. Since the tetrominos
+// only depend on the seed, playing the events on GameState(seed) gives the same game.
+// Inputs use the same letters as bots do (see bot.h), plus 'G' for gravity.
+enum ReplayInput : uint8_t {
+	ReplayLeft = 'L',
+	ReplayRight = 'R',
+	ReplayDown = 'D',
+	ReplayRotate = 'U',
+	ReplayDrop = ' ',
+	ReplayGravity = 'G',
+};
+
+struct ReplayHeader {
+	char magic[8];
+	uint64_t seed;
+	int32_t width;
+	int32_t height;
+};
+
+struct ReplayEvent {
+	// Milliseconds into the game
+	uint32_t time;
+	uint8_t input;
+	uint8_t padding[3];
+};
+
+const char replay_magic[8] = {'T', 'E', 'T', 'R', 'I', 'S', 'R', '1'};
+
+// Writes a replay of every game played on one board into a directory (--record)
+class Recorder
+{
+      public:
+	// The time to give the next events, kept up to date by whoever runs the game
+	uint32_t time = 0;
+
+	Recorder(const std::string &dir, int board) : dir(dir), board(board) {}
+	Recorder(const Recorder &) = delete;
+	Recorder &operator=(const Recorder &) = delete;
+
+	~Recorder() { this->finish(); }
+
+	void record(uint64_t seed, int width, int height, int pieces, uint8_t input)
+	{
+		if (seed != this->seed) {
+			this->finish();
+			this->seed = seed;
+			// A game picked up halfway can't be played back from its seed
+			if (pieces == 1 && seed != this->skipped) {
+				this->start(width, height);
+			}
+		}
+		if (this->file) {
+			ReplayEvent event = {this->time, input, {0, 0, 0}};
+			std::fwrite(&event, sizeof(event), 1, this->file);
+		}
+	}
+
+	// Leaves the game with this seed unrecorded
+	void skip(uint64_t seed) { this->skipped = seed; }
+
+	// Where the current game is being recorded, or nothing if it isn't
+	const std::string &path() const { return this->file_path; }
+
+	void flush()
+	{
+		if (this->file) {
+			std::fflush(this->file);
+		}
+	}
+
+      private:
+	std::string dir;
+	int board;
+	FILE *file = nullptr;
+	std::string file_path;
+	uint64_t seed = 0;
+	uint64_t skipped = 0;
+
+	void start(int width, int height)
+	{
+		// Never overwrite an earlier recording of the same seed
+		for (int n = 0; !this->file && n < 100; ++n) {
+			auto path = this->dir + "/" + std::to_string(this->seed) + "-" +
+				    std::to_string(this->board) + (n ? "-" + std::to_string(n) : "") +
+				    ".replay";
+			this->file = std::fopen(path.c_str(), "wbx");
+			if (this->file) {
+				this->file_path = path;
+			}
+		}
+		if (!this->file) {
+			std::cerr << "Failed to start a replay in " << this->dir << std::endl;
+			return;
+		}
+		ReplayHeader header = {{}, this->seed, width, height};
+		std::memcpy(header.magic, replay_magic, sizeof(header.magic));
+		std::fwrite(&header, sizeof(header), 1, this->file);
+	}
+
+	void finish()
+	{
+		if (this->file) {
+			std::fclose(this->file);
+			this->file = nullptr;
+		}
+		this->file_path.clear();
+	}
+};
+
+// The Recorder a game's inputs go to, if any. It stays with the GameState object it was set
+// on rather than being copied along with the game: copies made to look ahead, like the hint
+// search's, aren't recorded, and a board that gets a new game keeps recording.
+class Recording
+{
+      public:
+	Recorder *recorder = nullptr;
+
+	Recording() {}
+	Recording(const Recording &) {}
+	Recording &operator=(const Recording &) { return *this; }
+};
+
+// Something that happened in a game, for whoever wants to follow along without reading
+// GameState: the HUD, stats files, the network, bots
+struct GameEvent {
+	enum Kind : uint8_t {
+		// A tetromino locked in place
+		Lock,
+		// `rows` rows were cleared by the tetromino that just locked, taking the board
+		// down to nothing if `perfect` is set
+		LineClear,
+		// `level` is the new level
+		LevelUp,
+		// The board filled up to the top
+		Topout,
+	} kind;
+	// Which board, in the order the window has them
+	uint8_t board;
+	uint8_t rows;
+	bool perfect;
+	int32_t level;
+	int32_t score;
+	// Tetrominos that have entered the board so far (see GameState::pieces)
+	int32_t pieces;
+};
+
+// Every event from every board, in the order they happened. Only the thread running the
+// games pushes; see BroadcastRing for reading them.
+using GameEvents = BroadcastRing<GameEvent, 1024>;
+
+// Where a game's events go, if anywhere. Like Recording, it stays with the GameState object it
+// was set on, so looking ahead on a copy of the game never sends anything.
+class EventOutlet
+{
+      public:
+	GameEvents *events = nullptr;
+	uint8_t board = 0;
+
+	EventOutlet() {}
+	EventOutlet(const EventOutlet &) {}
+	EventOutlet &operator=(const EventOutlet &) { return *this; }
+};
+
+// One finished game on the leaderboard
+struct ScoreRecord {
+	uint64_t seed;
+	// Seconds since the epoch when the game ended
+	int64_t time;
+	int32_t score;
+	int32_t level;
+	int32_t pieces;
+	// 1 if the game ended at topout, 0 if it was given up on with a restart
+	int32_t finished;
+	// The path of the game's replay (see Recorder), zero padded, or empty if it wasn't
+	// recorded or the path didn't fit
+	char replay[56];
+	uint64_t checksum;
+};
+
+// Whether `a` ranks above `b`: the higher score, then whoever got it first
+bool ranks_above(const ScoreRecord &a, const ScoreRecord &b)
+{
+	if (a.score != b.score) {
+		return a.score > b.score;
+	}
+	if (a.time != b.time) {
+		return a.time < b.time;
+	}
+	return a.seed < b.seed;
+}
+
 class GameState
 {
       public:
@@ -244,65 +619,69 @@ class GameState
 	// The upcoming tetromino displayed in the preview box
 	Block preview_block;
 
-	GameState()
+	// One occupancy bitmask per row, kept in sync with `filled`.
+	// Bit x of rows[y] is set when (x, y) is filled. Only the first 64 columns are tracked.
+	// Bots see a copy of it (see BotDriver).
+	vector<uint64_t> rows = vector<uint64_t>(20);
+
+	// The row of the highest filled block in each column, or `height` for empty columns.
+	// Kept up to date on every lock and clear, so drop distances and game over don't need
+	// to look through `filled`.
+	vector<int> skyline = vector<int>(10, 20);
+
+	// The number of tetrominos that have entered the board so far
+	int pieces = 0;
+
+	// The seed the tetromino order was generated from, and the generator's current state.
+	// Two games with the same seed and the same inputs play out identically.
+	uint64_t seed;
+	uint64_t rng;
+
+	// Where the inputs played on this game are recorded
+	Recording recording;
+
+	// Where the events of this game go
+	EventOutlet outlet;
+
+	GameState() : GameState(std::random_device{}()) {}
+
+	GameState(uint64_t seed) : seed(seed), rng(seed)
 	{
 		this->replenish_pool();
 		this->next_block();
 	}
 
-	void replenish_pool()
+	// splitmix64
+	uint64_t random()
 	{
-		vector<vector<Location>> block_shapes = {
-		    // J Shape
-		    {{1, 0}, {1, 1}, {1, 2}, {2, 0}},
-		    // L Shape
-		    {{1, 0}, {1, 1}, {1, 2}, {0, 0}},
-		    // O Shope
-		    {{0, 0}, {0, 1}, {1, 0}, {1, 1}},
-		    // I Shape
-		    {{1, 0}, {1, 1}, {1, 2}, {1, 3}},
-		    // T shape
-		    {{1, 0}, {0, 1}, {1, 1}, {1, 2}},
-		    // Z shape
-		    {{0, 0}, {1, 0}, {1, 1}, {2, 1}},
-		    // S shape
-		    {{1, 0}, {2, 0}, {0, 1}, {1, 1}},
-		};
-
-		// Make a random number generator that provides random indices
-		std::random_device rd;
-		std::mt19937 gen(rd());
-		std::uniform_int_distribution<> distr(0, block_shapes.size() - 1);
-
-		vector<RGB> block_colors = {
-		    RGB{255, 0, 0},   RGB{0, 255, 0},  RGB{0, 0, 255},	RGB{255, 255, 0},
-		    RGB{0, 255, 255}, RGB{90, 0, 255}, RGB{255, 0, 90},
-		};
+		uint64_t z = (this->rng += 0x9e3779b97f4a7c15);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+		return z ^ (z >> 31);
+	}
 
-		vector<int> taken;
+	void replenish_pool()
+	{
+		// One bit per shape already in this bag
+		uint32_t taken = 0;
 		for (size_t i = 0; i < block_shapes.size(); ++i) {
-			auto num = distr(gen);
-			while (std::find(taken.begin(), taken.end(), num) != taken.end()) {
-				num = distr(gen);
+			int num = this->random() % block_shapes.size();
+			while (taken & (1u << num)) {
+				num = this->random() % block_shapes.size();
 			}
 			Block b;
 			b.locations = block_shapes[num];
 			b.color = block_colors[num];
 
 			this->block_pool.push_back(b);
-			taken.push_back(num);
+			taken |= 1u << num;
 		}
 	}
 
 	// Checks if any block in the top row of the board is filled
 	bool is_gameover()
 	{
-		for (int i = 0; i < this->width; ++i) {
-			if (is_filled(i, 0)) {
-				return true;
-			}
-		}
-		return false;
+		return *std::min_element(this->skyline.begin(), this->skyline.end()) == 0;
 	}
 
 	void next_block()
@@ -318,53 +697,91 @@ class GameState
 		auto i = this->block_pool.size() - 1;
 		this->preview_block = this->block_pool[i];
 		this->gameover = this->is_gameover();
+		this->pieces += 1;
 	}
 
 	void set_size(int h, int w)
 	{
 		this->height = h;
 		this->width = w;
+		this->rows.assign(h, 0);
+		this->skyline.assign(w, h);
 	}
 
 	void right()
 	{
-		if (block.can_move(1, 0, &filled) && block.max_x() < this->width - 1) {
-			block.offset_x += 1;
-		}
+		this->record(ReplayRight);
+		this->shift(1);
 	}
 
 	void left()
 	{
-		if (block.can_move(-1, 0, &filled) && block.min_x() > 0) {
-			block.offset_x -= 1;
+		this->record(ReplayLeft);
+		this->shift(-1);
+	}
+
+	// Moves the tetromino a column to the right (1) or left (-1), if there is room.
+	// Unlike right() and left() this isn't an input, so it isn't recorded.
+	void shift(int x)
+	{
+		bool inside = x > 0 ? block.max_x() < this->width - 1 : block.min_x() > 0;
+		if (this->fits(block, x, 0) && inside) {
+			block.offset_x += x;
+		}
+	}
+
+	// Whether `block` moved by (x, y) stays clear of the filled blocks, like Block::can_move().
+	// Where the row bitmasks cover every cell involved, this is a handful of ANDs (see
+	// simd.h) instead of a look through `filled`.
+	bool fits(Block &block, int x, int y)
+	{
+		uint64_t piece[4] = {0, 0, 0, 0};
+		auto cells = block.coordinates();
+		int top = cells[0].y + y;
+		for (const auto &loc : cells) {
+			top = std::min(top, loc.y + y);
+		}
+		for (const auto &loc : cells) {
+			int cx = loc.x + x;
+			int cy = loc.y + y;
+			if (cx < 0 || cx >= 64 || cy < 0 || cy >= this->height || cy - top >= 4) {
+				return block.can_move(x, y, &this->filled);
+			}
+			piece[cy - top] |= uint64_t(1) << cx;
 		}
+		return !rows_overlap(this->rows.data(), this->height, top, piece);
 	}
 
 	void clear_complete()
 	{
-		int rows = this->height;
-		for (int y = 0; y < this->height; ++y) {
-			bool filled = true;
-			for (int x = 0; x < this->width; ++x) {
-				if (!is_filled(x, y)) {
-					rows--;
-					filled = false;
-					break;
+		TRACE_SCOPE("clear_complete");
+		int rows = 0;
+		if (this->width <= 64) {
+			// A complete row is one whose bitmask has every column set, so they can be
+			// found 64 rows at a time. Removing a row only moves the ones above it.
+			uint64_t full = this->width == 64 ? ~uint64_t(0)
+							  : (uint64_t(1) << this->width) - 1;
+			for (int base = 0; base < this->height; base += 64) {
+				uint64_t complete = full_rows(this->rows.data() + base,
+							      std::min(64, this->height - base), full);
+				for (; complete; complete &= complete - 1) {
+					this->remove_row(base + __builtin_ctzll(complete));
+					rows++;
 				}
 			}
-			if (filled) {
-				// Erase filled row
-				this->filled.erase(std::remove_if(this->filled.begin(),
-								  this->filled.end(),
-								  [y](auto f) { return f.y == y; }),
-						   this->filled.end());
-
-				// Bring down rest of blocks
-				for (auto &loc : this->filled) {
-					if (loc.y <= y) {
-						loc.y += 1;
+		} else {
+			for (int y = 0; y < this->height; ++y) {
+				bool filled = true;
+				for (int x = 0; x < this->width; ++x) {
+					if (!is_filled(x, y)) {
+						filled = false;
+						break;
 					}
 				}
+				if (filled) {
+					this->remove_row(y);
+					rows++;
+				}
 			}
 		}
 		auto to_add = 0;
@@ -381,38 +798,127 @@ class GameState
 		}
 
 		this->score += to_add;
+		if (rows > 0) {
+			this->emit(GameEvent::LineClear, rows, this->filled.size() == 0);
+		}
 
 		this->level_left -= rows;
 		if (this->level_left < 1) {
 			this->level_left = 5;
 			this->level += 1;
 			this->tickspeed *= 0.75;
+			this->emit(GameEvent::LevelUp);
+		}
+	}
+
+	// Takes out a complete row, bringing everything above it down
+	void remove_row(int y)
+	{
+		this->filled.erase(std::remove_if(this->filled.begin(), this->filled.end(),
+						  [y](auto f) { return f.y == y; }),
+				   this->filled.end());
+		for (auto &loc : this->filled) {
+			if (loc.y <= y) {
+				loc.y += 1;
+			}
+		}
+		for (int r = y; r > 0; --r) {
+			this->rows[r] = this->rows[r - 1];
+		}
+		this->rows[0] = 0;
+
+		// Every column had a block in this row, so every column's top either came down
+		// with the rest, or was this row and is now whatever is below
+		for (int x = 0; x < this->width; ++x) {
+			if (this->skyline[x] < y) {
+				this->skyline[x] += 1;
+			} else {
+				this->skyline[x] = this->column_top(x, y + 1);
+			}
 		}
 	}
 
 	void down()
 	{
-		if (block.can_descend(&filled, height)) {
+		this->record(ReplayDown);
+		this->descend();
+	}
+
+	// down(), but by gravity rather than by the player
+	void fall()
+	{
+		this->record(ReplayGravity);
+		this->descend();
+	}
+
+	// Moves the tetromino down a row, or locks it in place if it can't go further
+	void descend()
+	{
+		if (this->drop_distance(block) > 0) {
 			block.offset_y += 1;
 			score += 1 * this->level;
 		} else {
 			for (const auto &loc : block.coordinates()) {
 				filled.push_back({loc.x, loc.y, block.color});
+				if (loc.y >= 0 && loc.y < height && loc.x >= 0 && loc.x < 64) {
+					rows[loc.y] |= uint64_t(1) << loc.x;
+				}
+				if (loc.y >= 0 && loc.x >= 0 && loc.x < width) {
+					skyline[loc.x] = std::min(skyline[loc.x], loc.y);
+				}
 			}
+			this->emit(GameEvent::Lock);
 
 			this->clear_complete();
 			this->next_block();
+			if (this->gameover) {
+				this->emit(GameEvent::Topout);
+			}
 		}
 	}
 
-	Block bottom(int *dropped)
+	// The highest filled row in column x, starting the search at row `from`
+	int column_top(int x, int from)
+	{
+		for (int y = from; y < this->height; ++y) {
+			if (x < 64 ? (this->rows[y] >> x) & 1 : this->is_filled(x, y)) {
+				return y;
+			}
+		}
+		return this->height;
+	}
+
+	// How many rows `block` can fall before it lands.
+	// As long as the tetromino is above the skyline, only the gap between each block and
+	// the top of its column matters. A tetromino slid under an overhang has to be stepped
+	// down the slow way.
+	int drop_distance(Block &block)
+	{
+		int d = this->height;
+		for (const auto &loc : block.coordinates()) {
+			if (loc.x < 0 || loc.x >= this->width || loc.y >= this->skyline[loc.x]) {
+				return this->drop_distance_slow(block);
+			}
+			d = std::min(d, this->skyline[loc.x] - loc.y - 1);
+		}
+		return d;
+	}
+
+	int drop_distance_slow(Block block)
 	{
 		int d = 0;
-		Block tmp = this->block;
-		while (tmp.can_descend(&filled, height)) {
-			tmp.offset_y += 1;
+		while (this->fits(block, 0, 1) && block.max_y() < this->height - 1) {
+			block.offset_y += 1;
 			d += 1;
 		}
+		return d;
+	}
+
+	Block bottom(int *dropped)
+	{
+		Block tmp = this->block;
+		int d = this->drop_distance(tmp);
+		tmp.offset_y += d;
 		if (dropped) {
 			*dropped = d;
 		}
@@ -421,9 +927,10 @@ class GameState
 
 	void drop()
 	{
+		this->record(ReplayDrop);
 		int dropped = 0;
 		this->block = this->bottom(&dropped);
-		this->down();
+		this->descend();
 		this->score += dropped * this->level;
 	}
 
@@ -436,14 +943,16 @@ class GameState
 			if (this->is_filled(loc.x, loc.y)) {
 				return false;
 			} else if (loc.x > this->width - 1) {
-				if (block.can_move(-1, 0, &filled)) {
-					this->left();
+				// Kicked off the wall. Playing back the rotation kicks it again, so
+				// the kick mustn't be recorded as a move of its own.
+				if (this->fits(block, -1, 0)) {
+					this->shift(-1);
 					continue;
 				}
 				return false;
 			} else if (loc.x < 0) {
-				if (block.can_move(1, 0, &filled)) {
-					this->right();
+				if (this->fits(block, 1, 0)) {
+					this->shift(1);
 					continue;
 				}
 				return false;
@@ -455,6 +964,9 @@ class GameState
 
 	bool is_filled(int x, int y)
 	{
+		if (x >= 0 && x < 64 && y >= 0 && y < this->height) {
+			return (this->rows[y] >> x) & 1;
+		}
 		for (const auto &loc : filled) {
 			if (loc.x == x && loc.y == y) {
 				return true;
@@ -465,628 +977,5589 @@ class GameState
 
 	void rotate()
 	{
-		if (block.can_descend(&filled, height) && can_rotate()) {
+		this->record(ReplayRotate);
+		if (this->fits(block, 0, 1) && block.max_y() < this->height - 1 && can_rotate()) {
 			this->block.rotate();
 		}
 	}
-};
 
-class Button
-{
-      public:
-	std::string id;
-	SDL_Rect box;
-	SDL_Surface *image;
-	bool visible = true;
+	// Plays an input read back from a replay
+	void replay(uint8_t input)
+	{
+		switch (input) {
+		case ReplayLeft:
+			this->left();
+			break;
+		case ReplayRight:
+			this->right();
+			break;
+		case ReplayDown:
+			this->down();
+			break;
+		case ReplayRotate:
+			this->rotate();
+			break;
+		case ReplayDrop:
+			this->drop();
+			break;
+		case ReplayGravity:
+			this->fall();
+			break;
+		}
+	}
 
-	bool contains(int x, int y)
+	void record(uint8_t input)
 	{
-		if (x >= box.x && x <= box.x + box.w && y >= box.y && y <= box.y + box.h) {
-			return true;
+		if (this->recording.recorder && !this->gameover) {
+			this->recording.recorder->record(this->seed, this->width, this->height,
+							 this->pieces, input);
+		}
+	}
+
+	void emit(GameEvent::Kind kind, int rows = 0, bool perfect = false)
+	{
+		if (this->outlet.events) {
+			this->outlet.events->push(GameEvent{kind, this->outlet.board, uint8_t(rows),
+							    perfect, this->level, this->score,
+							    this->pieces});
 		}
-		return false;
 	}
 };
 
-class GameContext
+// Where a tetromino could be put, found by searching every rotation and column
+struct Placement {
+	// The tetromino where it comes to rest
+	Block block;
+	int rotations = 0;
+	// The leftmost column the tetromino covers
+	int x = 0;
+	double value = 0;
+	bool found = false;
+	// Set when the placement is the first step of a perfect clear (see PerfectClear)
+	bool perfect = false;
+};
+
+// Scores a board by how easy it will be to keep playing on. Higher is better.
+// The weights are the usual ones for aggregate height, cleared rows, holes and bumpiness.
+double evaluate(const GameState &game, int cleared)
 {
-      public:
-	// SDL values used for rendering the game
-	SDL_Window *window;
-	SDL_Surface *window_surface;
-	SDL_Renderer *renderer;
+	int heights[64] = {};
+	int holes = 0;
+	int width = std::min(game.width, 64);
+	for (int x = 0; x < width; ++x) {
+		bool roof = false;
+		for (int y = 0; y < game.height; ++y) {
+			bool filled = (game.rows[y] >> x) & 1;
+			if (filled && !roof) {
+				roof = true;
+				heights[x] = game.height - y;
+			} else if (!filled && roof) {
+				holes += 1;
+			}
+		}
+	}
 
-	// The height and width of the game window
-	int height = 835;
-	int width = 645;
+	int aggregate = 0;
+	int bumpiness = 0;
+	for (int x = 0; x < width; ++x) {
+		aggregate += heights[x];
+		if (x > 0) {
+			bumpiness += std::abs(heights[x] - heights[x - 1]);
+		}
+	}
 
-	// The main font used for rendering text to the screen.
-	// Currently Sans.ttf
-	TTF_Font *font;
+	return -0.51 * aggregate + 0.76 * cleared - 0.36 * holes - 0.18 * bumpiness;
+}
 
-	// The x and y offsets for the position of the game itself.
-	// In most cases x will be determined by whatever makes the
-	// game centered and y will be zero.
-	Location game_offset;
+int count_filled(const GameState &game)
+{
+	int count = 0;
+	for (const auto &row : game.rows) {
+		count += __builtin_popcountll(row);
+	}
+	return count;
+}
 
-	// An instance of GameState, which contains the inner-workings of the game.
-	// State for the game should not be stored elsewhere.
-	GameState game;
+// Moves the falling tetromino the way a player would: rotated `rotations` times, then over
+// until its leftmost block is in column x. False if it can't get there.
+bool steer(GameState &game, int rotations, int x)
+{
+	for (int i = 0; i < rotations; ++i) {
+		game.rotate();
+	}
+	while (game.block.min_x() > x) {
+		auto before = game.block.offset_x;
+		game.left();
+		if (before == game.block.offset_x) {
+			break;
+		}
+	}
+	while (game.block.min_x() < x) {
+		auto before = game.block.offset_x;
+		game.right();
+		if (before == game.block.offset_x) {
+			break;
+		}
+	}
+	return game.block.min_x() == x;
+}
 
-	// The song to be run in the background.
-	// Loaded from Korobeiniki.wav
-	Mix_Chunk *music;
+// Finds the best placement for the falling tetromino, looking `depth` tetrominos ahead
+// (the preview is the only one known, so depth 2 is as far as it goes).
+// Gives up, returning nothing, as soon as `cancel` stops being equal to `generation`.
+Placement best_placement(const GameState &game, int depth, const std::atomic<uint64_t> &cancel,
+			 uint64_t generation)
+{
+	Placement best;
+	for (int r = 0; r < 4; ++r) {
+		for (int x = 0; x < game.width; ++x) {
+			if (cancel != generation) {
+				return Placement{};
+			}
 
-	// The size (in pixels) of individual blocks.
-	// A tetromino consists of multiple blocks.
-	int block_size = double(height) * 0.05;
-	int paused = false;
+			// Move a copy of the game the same way a player would
+			GameState sim = game;
+			if (!steer(sim, r, x)) {
+				continue;
+			}
 
-	// Current state within the loop
-	SDL_Event event;
-	int last_time;
-	bool redraw = true;
-	bool should_continue = true;
-	bool rotation_pressed = false;
-	bool space_pressed = false;
+			auto landed = sim.bottom(nullptr);
+			auto filled = count_filled(sim);
+			sim.drop();
+			if (sim.gameover) {
+				continue;
+			}
 
-	vector<Button> buttons;
+			int cleared = (filled + int(landed.locations.size()) - count_filled(sim)) /
+				      std::max(sim.width, 1);
+			double value = evaluate(sim, cleared);
+			if (depth > 1) {
+				auto next = best_placement(sim, depth - 1, cancel, generation);
+				if (!next.found) {
+					if (cancel != generation) {
+						return Placement{};
+					}
+					continue;
+				}
+				value += next.value;
+			}
 
-	bool mute = false;
+			if (!best.found || value > best.value) {
+				best = Placement{
+				    .block = landed,
+				    .rotations = r,
+				    .x = x,
+				    .value = value,
+				    .found = true,
+				};
+			}
+		}
+	}
+	return best;
+}
 
-	// Initializes SDL and the game state
-	GameContext()
+// Memoized results of the perfect clear search, shared by every search on every thread.
+// Each entry is one word: the high bits of a hash of the position, and what the search found
+// there, so entries are written and read whole without locks. Two positions sharing a slot
+// simply replace each other. The table is allocated the first time it is used, and can be
+// saved to a file and loaded again (--pc-build and --pc-table).
+class PerfectClearTable
+{
+      public:
+	// The position has no perfect clear with the tetrominos it was searched with
+	static constexpr uint8_t dead = 1;
+	// Anything from `first_move` up has one, starting with move `value - first_move`, which
+	// the search tries before any other when it comes back to the position
+	static constexpr uint8_t first_move = 2;
+
+	// 2^20 entries, 8 MB
+	static constexpr int bits = 20;
+
+	// A position: the field (see PerfectClearSearch), the width of the board and how many
+	// rows it may use, and the `count` tetrominos that have to fill them, by their index in
+	// block_shapes
+	static uint64_t key(uint64_t field, int width, int rows, const int *shapes, int count)
 	{
-		if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) != 0) {
-			throw "Failed to initialize SDL2";
+		uint64_t queue = count;
+		for (int i = 0; i < count; ++i) {
+			queue = queue << 3 | shapes[i];
 		}
+		uint64_t size = uint64_t(width) << 8 | rows;
+		return mix(mix(mix(field) ^ size) ^ queue) | 0xff;
+	}
 
-		this->window =
-		    SDL_CreateWindow("TETRIS", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-				     this->width, this->height, 0);
-		if (window == nullptr) {
-			throw "Failed to create window";
+	uint8_t find(uint64_t key)
+	{
+		auto *entries = this->entries();
+		size_t index = key >> (64 - bits);
+		for (size_t slot : {index, index ^ 1}) {
+			uint64_t entry = entries[slot].load(std::memory_order_relaxed);
+			if ((entry | 0xff) == key) {
+				return entry & 0xff;
+			}
 		}
+		return 0;
+	}
 
-		this->renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+	void store(uint64_t key, uint8_t value)
+	{
+		auto *entries = this->entries();
+		size_t index = key >> (64 - bits);
+		uint64_t entry = entries[index].load(std::memory_order_relaxed);
+		if (entry != 0 && (entry | 0xff) != key) {
+			index ^= 1;
+		}
+		entries[index].store((key & ~uint64_t(0xff)) | value, std::memory_order_relaxed);
+	}
 
-		GameState game;
-		game.set_size(20, 10);
-		this->game = game;
+	// Allocates the table now, rather than the first time it is used
+	void allocate() { this->entries(); }
 
-		this->game_offset = {10, 10};
+	// Replaces the table with the one saved at `path`. False, leaving the table alone, if
+	// there isn't one there.
+	bool load(const std::string &path)
+	{
+		MappedFile file;
+		Header header;
+		if (!file.open(path.c_str()) || file.size != sizeof(header) + size() * 8) {
+			return false;
+		}
+		std::memcpy(&header, file.data, sizeof(header));
+		if (std::memcmp(header.magic, magic, sizeof(header.magic)) != 0 ||
+		    header.bits != bits) {
+			return false;
+		}
+		auto *entries = this->entries();
+		for (size_t i = 0; i < size(); ++i) {
+			uint64_t entry;
+			std::memcpy(&entry, file.data + sizeof(header) + i * 8, 8);
+			entries[i].store(entry, std::memory_order_relaxed);
+		}
+		return true;
+	}
 
-		TTF_Init();
-		this->font = TTF_OpenFont("assets/Sans.ttf", 14);
-		if (!this->font) {
-			throw "Failed to load Sans.ttf";
+	bool save(const std::string &path)
+	{
+		FILE *out = std::fopen(path.c_str(), "wb");
+		if (!out) {
+			return false;
 		}
+		Header header = {};
+		std::memcpy(header.magic, magic, sizeof(header.magic));
+		header.bits = bits;
+		bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1;
+		auto *entries = this->entries();
+		for (size_t i = 0; ok && i < size(); ++i) {
+			uint64_t entry = entries[i].load(std::memory_order_relaxed);
+			ok = std::fwrite(&entry, sizeof(entry), 1, out) == 1;
+		}
+		return std::fclose(out) == 0 && ok;
+	}
 
-		Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048);
-		Mix_Volume(-1, 50);
+      private:
+	struct Header {
+		char magic[8];
+		uint32_t bits;
+		uint32_t reserved;
+	};
 
-		this->music = Mix_LoadWAV("assets/Korobeiniki.wav");
-		Mix_PlayChannel(-1, this->music, -1);
+	static constexpr const char *magic = "TETRISP2";
 
-		SDL_SetWindowResizable(window, SDL_TRUE);
+	std::once_flag allocated;
+	std::unique_ptr<std::atomic<uint64_t>[]> table;
 
-		this->last_time = SDL_GetTicks();
+	static constexpr size_t size() { return size_t(1) << bits; }
 
-		this->buttons = {
-		    Button{
-			.id = "replay",
-			.box =
-			    SDL_Rect{
-				.x = 0,
-				.y = 0,
-				.w = 0,
-				.h = 0,
-			    },
-			.image = IMG_Load("assets/replay.png"),
-		    },
-		    Button{
-			.id = "mute",
-			.box =
-			    SDL_Rect{
-				.x = 0,
-				.y = 0,
-				.w = 0,
-				.h = 0,
-			    },
-			.image = IMG_Load("assets/mute.png"),
-		    },
-		    Button{
-			.id = "unmute",
-			.box =
-			    SDL_Rect{
-				.x = 0,
-				.y = 0,
-				.w = 0,
-				.h = 0,
-			    },
-			.image = IMG_Load("assets/unmute.png"),
-		    },
-		};
+	// The splitmix64 finalizer
+	static uint64_t mix(uint64_t z)
+	{
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+		return z ^ (z >> 31);
 	}
 
-	void resize(int w, int h)
+	std::atomic<uint64_t> *entries()
 	{
-		// Proportionally resize based on height first, then width
-		if (h != this->height) {
-			this->height = h;
-			this->width = height / 1.295;
-		} else if (w != this->width) {
-			this->width = w;
-			this->height = width * 1.295;
+		std::call_once(this->allocated, [this]() {
+			this->table = std::make_unique<std::atomic<uint64_t>[]>(size());
+		});
+		return this->table.get();
+	}
+};
+
+PerfectClearTable perfect_clears;
+
+// A way to clear the board completely with the tetrominos known so far: the falling one and
+// the ones in the pool. Each move is for steer(), and then the tetromino is dropped.
+struct PerfectClear {
+	static constexpr int max_moves = 8;
+
+	bool found = false;
+	int count = 0;
+	int rotations[max_moves];
+	int x[max_moves];
+};
+
+// The shape a tetromino has, as an index into block_shapes. Every shape has its own color.
+int shape_of(const Block &block)
+{
+	for (size_t i = 0; i < block_colors.size(); ++i) {
+		auto &color = block_colors[i];
+		if (color.r == block.color.r && color.g == block.color.g && color.b == block.color.b) {
+			return i;
 		}
-		SDL_SetWindowSize(this->window, width, height);
-		this->block_size = double(this->height - this->game_offset.y) * 0.05;
-		this->game_offset = {this->block_size / 4, this->block_size / 4};
 	}
+	return 0;
+}
 
-	void pause()
+// Looks for a perfect clear of a board whose blocks are all in its bottom four rows, for
+// find_perfect_clear(). The board is a field: bit `row * width + x` is set when column x of
+// the row'th row from the bottom is filled. Every tetromino is hard dropped, and the search
+// only considers clearing the bottom `rows` rows, so no tetromino may stick out above them.
+class PerfectClearSearch
+{
+      public:
+	static const int max_rows = 4;
+	static const int max_width = 12;
+
+	// One way a tetromino can be turned, with its cells counted from its leftmost column
+	// and bottom row
+	struct Orientation {
+		int rotations;
+		int width;
+		int height;
+		Location cells[4];
+	};
+
+	// The orientations of a tetromino. There are never more than four, so like Cells they
+	// are kept inline, and working them out never allocates.
+	struct Orientations {
+		Orientation items[4];
+		int count = 0;
+
+		const Orientation *begin() const { return this->items; }
+		const Orientation *end() const { return this->items + this->count; }
+	};
+
+	// The orientations `block` can be turned to, from how it is now, leaving out repeats
+	static Orientations orientations(Block block)
 	{
-		this->paused = true;
-		Mix_Pause(-1);
+		Orientations result;
+		for (int r = 0; r < 4; ++r, block.rotate()) {
+			if (block.locations.size() != 4) {
+				return {};
+			}
+			int left = block.locations[0].x;
+			int right = left;
+			int top = block.locations[0].y;
+			int bottom = top;
+			for (const auto &loc : block.locations) {
+				left = std::min(left, loc.x);
+				right = std::max(right, loc.x);
+				top = std::min(top, loc.y);
+				bottom = std::max(bottom, loc.y);
+			}
+			Orientation orientation = {r, right - left + 1, bottom - top + 1, {}};
+			for (int i = 0; i < 4; ++i) {
+				orientation.cells[i] = {block.locations[i].x - left,
+							bottom - block.locations[i].y};
+			}
+			std::sort(std::begin(orientation.cells), std::end(orientation.cells),
+				  [](const auto &a, const auto &b) {
+					  return a.y != b.y ? a.y < b.y : a.x < b.x;
+				  });
+			bool repeat = false;
+			for (const auto &other : result) {
+				repeat |= std::equal(std::begin(other.cells), std::end(other.cells),
+						     std::begin(orientation.cells),
+						     [](const auto &a, const auto &b) {
+							     return a.x == b.x && a.y == b.y;
+						     });
+			}
+			if (!repeat) {
+				result.items[result.count++] = orientation;
+			}
+		}
+		return result;
 	}
 
-	void resume()
+	// Every shape as it enters the board
+	static const vector<Orientations> &spawned()
 	{
-		this->paused = false;
-		Mix_Resume(-1);
+		static const vector<Orientations> all = []() {
+			vector<Orientations> all;
+			for (const auto &shape : block_shapes) {
+				Block block;
+				block.locations = shape;
+				all.push_back(orientations(block));
+			}
+			return all;
+		}();
+		return all;
 	}
 
-	void reset()
+	enum Result { Found, Dead, Unknown };
+
+	PerfectClearSearch(PerfectClearTable &table, int width, const Orientations &first,
+			   const int *shapes, int count,
+			   std::chrono::steady_clock::time_point deadline,
+			   const std::atomic<uint64_t> &cancel, uint64_t generation)
+	    : table(table), width(width), first(first), shapes(shapes), count(count),
+	      deadline(deadline), cancel(cancel), generation(generation)
 	{
-		GameState g;
-		this->game = g;
-		Mix_HaltChannel(-1);
-		Mix_PlayChannel(-1, this->music, -1);
 	}
 
-	void loop()
+	// Searches from `field`, with the first `moves` tetrominos placed, to clear `rows` rows
+	Result search(uint64_t field, int rows, int moves)
 	{
-		SDL_PollEvent(&this->event);
+		int empty = this->width * rows - __builtin_popcountll(field);
+		int needed = empty / 4;
+		if (empty % 4 != 0) {
+			return Dead;
+		}
+		if (moves + needed > this->count) {
+			return Unknown;
+		}
+		if (++this->nodes % 256 == 0 &&
+		    (std::chrono::steady_clock::now() > this->deadline ||
+		     this->cancel != this->generation)) {
+			this->out_of_time = true;
+		}
+		if (this->out_of_time) {
+			return Unknown;
+		}
 
-		if (this->paused) {
-			if (this->event.type == SDL_WINDOWEVENT &&
-			    this->event.window.event == SDL_WINDOWEVENT_FOCUS_GAINED) {
-			} else {
-				return;
+		// The falling tetromino may have been turned already, so only the ones after it
+		// are the same every time
+		uint64_t key = 0;
+		int known = -1;
+		if (moves > 0) {
+			key = PerfectClearTable::key(field, this->width, rows, this->shapes + moves,
+						     needed);
+			uint8_t value = this->table.find(key);
+			if (value == PerfectClearTable::dead) {
+				return Dead;
+			}
+			if (value >= PerfectClearTable::first_move) {
+				known = value - PerfectClearTable::first_move;
 			}
 		}
 
-		switch (this->event.type) {
-		case SDL_QUIT:
-			this->should_continue = false;
-			break;
-		case SDL_KEYDOWN:
-			if (!this->game.gameover) {
-				this->redraw = true;
-				switch (this->event.key.keysym.sym) {
-				case SDLK_RIGHT:
-					this->game.right();
-					break;
-				case SDLK_LEFT:
-					this->game.left();
-					break;
-				case SDLK_DOWN:
-					this->game.down();
-					break;
-				case SDLK_UP:
-					if (!this->rotation_pressed) {
-						this->game.rotate();
-						this->rotation_pressed = true;
-					}
-					break;
-				case SDLK_SPACE:
-					if (!this->space_pressed) {
-						this->game.drop();
-						this->space_pressed = true;
-					}
-					break;
-				default:
+		int heights[max_width] = {};
+		for (int x = 0; x < this->width; ++x) {
+			for (int y = rows - 1; y >= 0; --y) {
+				if ((field >> (y * this->width + x)) & 1) {
+					heights[x] = y + 1;
 					break;
 				}
 			}
-			// Unconditional keypresses
-			switch (this->event.key.keysym.sym) {
-			case SDLK_r:
-				this->reset();
-				break;
-			case SDLK_m:
-				if (this->mute) {
-					this->mute = false;
-					Mix_Volume(-1, 80);
-				} else {
-					this->mute = true;
-					Mix_Volume(-1, 0);
+		}
+
+		auto &options = moves == 0 ? this->first : spawned()[this->shapes[moves]];
+		if (known >= 0) {
+			// The move that cleared this position before will most likely do it again
+			int x = known % 16;
+			for (const auto &orientation : options) {
+				if (orientation.rotations != known / 16) {
+					continue;
+				}
+				Result result =
+				    this->place(field, rows, moves, heights, orientation, x);
+				if (result == Found) {
+					return Found;
 				}
-				break;
-			default:
-				break;
-			}
-			break;
-		case SDL_KEYUP:
-			switch (this->event.key.keysym.sym) {
-			case SDLK_UP:
-				this->rotation_pressed = false;
-				break;
-			case SDLK_SPACE:
-				this->space_pressed = false;
-				break;
-			}
-			break;
-		case SDL_WINDOWEVENT:
-			this->redraw = true;
-			switch (this->event.window.event) {
-			case SDL_WINDOWEVENT_FOCUS_LOST:
-				this->pause();
-				break;
-			case SDL_WINDOWEVENT_FOCUS_GAINED:
-				this->resume();
-				break;
-			case SDL_WINDOWEVENT_RESIZED:
-				int w, h;
-				SDL_GetWindowSize(this->window, &w, &h);
-				this->resize(w, h);
-				break;
 			}
-			break;
-		case SDL_MOUSEBUTTONUP:
-			if (this->event.button.button == SDL_BUTTON_LEFT) {
-				auto x = this->event.button.x;
-				auto y = this->event.button.y;
-				for (auto &button : this->buttons) {
-					if (button.contains(x, y) && button.visible) {
-						this->redraw = true;
-						if (button.id == "replay") {
-							this->reset();
-							break;
-						}
-						if (button.id == "unmute") {
-							this->mute = false;
-							Mix_Volume(-1, 80);
-							break;
-						}
-						if (button.id == "mute") {
-							this->mute = true;
-							Mix_Volume(-1, 0);
-							break;
-						}
+		}
+		bool unknown = false;
+		for (const auto &orientation : options) {
+			for (int x = 0; x + orientation.width <= this->width; ++x) {
+				Result result =
+				    this->place(field, rows, moves, heights, orientation, x);
+				if (result == Found) {
+					if (key) {
+						// The rotations and column of this move
+						int step = orientation.rotations * 16 + x;
+						step += PerfectClearTable::first_move;
+						this->table.store(key, step);
 					}
+					return Found;
 				}
+				unknown |= result == Unknown;
 			}
-			break;
-		default:
-			break;
 		}
+		if (!unknown && key) {
+			this->table.store(key, PerfectClearTable::dead);
+		}
+		return unknown ? Unknown : Dead;
+	}
 
-		if (SDL_GetTicks() - last_time > this->game.tickspeed && !this->game.gameover) {
-			this->game.down();
-			last_time = SDL_GetTicks();
-			this->redraw = true;
+	// The moves of what search() found, in order
+	int length = 0;
+	int rotations[PerfectClear::max_moves];
+	int columns[PerfectClear::max_moves];
+
+      private:
+	PerfectClearTable &table;
+	int width;
+	const Orientations &first;
+	const int *shapes;
+	int count;
+	std::chrono::steady_clock::time_point deadline;
+	const std::atomic<uint64_t> &cancel;
+	uint64_t generation;
+	int nodes = 0;
+	bool out_of_time = false;
+
+	// Drops `orientation` in column `x` of `field` and searches on from there
+	Result place(uint64_t field, int rows, int moves, const int *heights,
+		     const Orientation &orientation, int x)
+	{
+		if (x + orientation.width > this->width) {
+			return Dead;
+		}
+		// Where the tetromino's bottom row lands
+		int base = 0;
+		for (const auto &cell : orientation.cells) {
+			base = std::max(base, heights[x + cell.x] - cell.y);
+		}
+		if (base + orientation.height > rows) {
+			return Dead;
 		}
+		uint64_t placed = field;
+		for (const auto &cell : orientation.cells) {
+			int bit = (base + cell.y) * this->width + x + cell.x;
+			placed |= uint64_t(1) << bit;
+		}
+		int left = rows;
+		placed = this->clear(placed, left);
+
+		this->rotations[moves] = orientation.rotations;
+		this->columns[moves] = x;
+		Result result = placed == 0 ? Found : Dead;
+		if (result != Found && this->splittable(placed, left)) {
+			result = this->search(placed, left, moves + 1);
+		}
+		if (result == Found && moves + 1 > this->length) {
+			this->length = moves + 1;
+		}
+		return result;
+	}
 
-		if (this->redraw) {
-			this->draw();
-			SDL_UpdateWindowSurface(this->window);
-			this->redraw = false;
+	// Takes out the complete rows of `field`, bringing the ones above down
+	uint64_t clear(uint64_t field, int &rows)
+	{
+		uint64_t full = (uint64_t(1) << this->width) - 1;
+		for (int y = rows - 1; y >= 0; --y) {
+			int shift = y * this->width;
+			if (((field >> shift) & full) == full) {
+				uint64_t below = field & ((uint64_t(1) << shift) - 1);
+				field = below | ((field >> (shift + this->width)) << shift);
+				rows -= 1;
+			}
 		}
+		return field;
 	}
 
-	void draw()
+	// False if a column filled all the way up walls off a part of the board that no number
+	// of tetrominos can fill exactly
+	bool splittable(uint64_t field, int rows)
 	{
-		// Number of digits in each statistic type
+		int empty = 0;
+		for (int x = 0; x < this->width; ++x) {
+			int filled = 0;
+			for (int y = 0; y < rows; ++y) {
+				filled += (field >> (y * this->width + x)) & 1;
+			}
+			if (filled == rows && empty % 4 != 0) {
+				return false;
+			}
+			if (filled == rows) {
+				empty = 0;
+			} else {
+				empty += rows - filled;
+			}
+		}
+		return true;
+	}
+};
 
-		int scoreLength = std::to_string(abs(game.score)).length();
-		int levelLength = std::to_string(abs(game.level)).length();
+// How long the hint search spends looking for a perfect clear before settling for the best
+// placement, so that the hint still comes within a frame or so
+const auto perfect_clear_budget = std::chrono::milliseconds(12);
+
+// Looks for a perfect clear of `game` that needs no tetromino beyond those already known,
+// on a board whose blocks are all in its bottom four rows. Gives up, finding nothing, at
+// `deadline` or as soon as `cancel` stops being equal to `generation`. What it learns on the
+// way is kept in perfect_clears, so asking again about the same board, or one after it on
+// the way to a clear, is quicker and gets further. A clear that is found is played out to
+// make sure, on `scratch` if given: once that has room for the game, and perfect_clears and
+// PerfectClearSearch::spawned() have been set up, nothing here allocates.
+PerfectClear find_perfect_clear(const GameState &game,
+				std::chrono::steady_clock::time_point deadline,
+				const std::atomic<uint64_t> &cancel, uint64_t generation,
+				GameState *scratch = nullptr)
+{
+	PerfectClear clear;
+	int width = game.width;
+	if (game.gameover || width > PerfectClearSearch::max_width) {
+		return clear;
+	}
 
-		if (scoreLength > 6) {
-			scoreLength = 6;
+	uint64_t row = (uint64_t(1) << width) - 1;
+	uint64_t field = 0;
+	int stack = 0;
+	for (int y = 0; y < game.height; ++y) {
+		uint64_t cells = game.rows[game.height - 1 - y] & row;
+		if (cells == 0) {
+			continue;
 		}
-		if (levelLength > 6) {
-			levelLength = 6;
+		if (y >= PerfectClearSearch::max_rows) {
+			return clear;
 		}
+		field |= cells << (y * width);
+		stack = y + 1;
+	}
 
-		// Set SDL screen to gray
-		SDL_SetRenderDrawColor(this->renderer, 84, 84, 84, 255);
-		SDL_RenderClear(this->renderer);
+	// The falling tetromino, then the pool from the end it is taken from
+	int shapes[PerfectClear::max_moves];
+	int count = 0;
+	shapes[count++] = shape_of(game.block);
+	for (auto i = game.block_pool.rbegin();
+	     i != game.block_pool.rend() && count < PerfectClear::max_moves; ++i) {
+		shapes[count++] = shape_of(*i);
+	}
+	auto first = PerfectClearSearch::orientations(game.block);
+	PerfectClearSearch search(perfect_clears, width, first, shapes, count, deadline, cancel,
+				  generation);
+	// The fewest rows, and so the fewest tetrominos, first
+	for (int rows = std::max(stack, 1); rows <= PerfectClearSearch::max_rows; ++rows) {
+		if (search.search(field, rows, 0) != PerfectClearSearch::Found) {
+			continue;
+		}
 
-		// Left and right borders of the Tetris board
-		int rightBorder = this->game_offset.x + this->game.width * this->block_size;
+		// Make sure the game really plays out that way
+		std::unique_ptr<GameState> copy;
+		if (scratch) {
+			*scratch = game;
+		} else {
+			copy = std::make_unique<GameState>(game);
+			scratch = copy.get();
+		}
+		auto &check = *scratch;
+		for (int i = 0; i < search.length; ++i) {
+			if (!steer(check, search.rotations[i], search.columns[i])) {
+				return clear;
+			}
+			check.drop();
+		}
+		if (!check.filled.empty() || check.gameover) {
+			return clear;
+		}
 
-		// Set SDL screen to black
-		SDL_SetRenderDrawColor(this->renderer, 0, 0, 0, 255);
+		clear.found = true;
+		clear.count = search.length;
+		std::copy(search.rotations, search.rotations + search.length, clear.rotations);
+		std::copy(search.columns, search.columns + search.length, clear.x);
+		return clear;
+	}
+	return clear;
+}
 
-		SDL_Rect board = {
-		    .x = this->game_offset.x,
-		    .y = this->game_offset.y,
-		    .w = this->game.width * this->block_size,
-		    .h = this->game.height * this->block_size,
-		};
-		SDL_RenderFillRect(renderer, &board);
+// The first step of `clear`, as a placement of the falling tetromino
+Placement first_step(const GameState &game, const PerfectClear &clear)
+{
+	GameState sim = game;
+	steer(sim, clear.rotations[0], clear.x[0]);
+	return Placement{
+	    .block = sim.bottom(nullptr),
+	    .rotations = clear.rotations[0],
+	    .x = clear.x[0],
+	    .value = 0,
+	    .found = true,
+	    .perfect = true,
+	};
+}
 
-		// Scoreboard
-		int box_scale = 5;
+// Bots see tetromino cells through bot.h, without copying them
+static_assert(sizeof(Location) == sizeof(tetris_bot_cell), "Location must match tetris_bot_cell");
 
-		SDL_Rect scoreboard = {
-		    .x = rightBorder + (this->block_size / 4),
-		    .y = this->block_size / 4,
-		    .w = this->block_size * box_scale,
-		    .h = this->block_size * box_scale,
-		};
-		SDL_RenderFillRect(renderer, &scoreboard);
+// A bot loaded from a shared object. See bot.h for what it has to export.
+class BotPlugin
+{
+      public:
+	std::string path;
+	void *handle;
 
-		SDL_Rect scoretext = {
-		    .x = scoreboard.x + scoreboard.w / 6,
-		    .y = scoreboard.y,
-		    .w = (scoreboard.w * 2) / 3,
-		    .h = scoreboard.h / 3,
-		};
-		SDL_RenderFillRect(renderer, &scoretext);
+	int32_t (*think)(void *, const tetris_bot_state *, tetris_bot_move *);
+	void *(*create)(void);
+	void (*destroy)(void *);
 
-		// How far the score needs to be pushed to the left
-		int modifier = scoreLength * (block_size / 4);
-		int levelModifier = levelLength * (block_size / 4);
+	// Set when a bot never returned from a call, so its code has to stay mapped
+	bool pinned = false;
 
-		SDL_Rect livescore = {
-		    .x = scoreboard.x + (scoreboard.w / 2) - modifier,
-		    .y = scoreboard.y + (scoreboard.h * 2 / 5),
-		    .w = (scoreboard.w / (box_scale * 2)) * scoreLength,
-		    .h = scoreboard.h / 3,
-		};
-		SDL_RenderFillRect(renderer, &livescore);
-		// End scoreboard
+	BotPlugin(const std::string &path) : path(path)
+	{
+		this->handle = SDL_LoadObject(path.c_str());
+		if (!this->handle) {
+			throw SdlError("Failed to load bot " + path);
+		}
 
-		// Level board
-		SDL_Rect levelboard = {
-		    .x = rightBorder + (this->block_size / 4),
-		    .y = (this->block_size / 4 * 2) + (this->block_size * box_scale),
-		    .w = this->block_size * box_scale,
-		    .h = this->block_size * box_scale,
-		};
-		SDL_RenderFillRect(renderer, &levelboard);
+		auto abi_version = reinterpret_cast<int32_t (*)(void)>(
+		    SDL_LoadFunction(this->handle, "tetris_bot_abi_version"));
+		if (!abi_version || abi_version() != TETRIS_BOT_ABI_VERSION) {
+			SDL_UnloadObject(this->handle);
+			throw std::runtime_error(path + " was built for a different version of bot.h");
+		}
 
-		SDL_Rect leveltext = {
-		    .x = levelboard.x + levelboard.w / 6,
-		    .y = levelboard.y,
-		    .w = (levelboard.w * 2) / 3,
-		    .h = scoreboard.h / 3,
-		};
-		SDL_RenderFillRect(renderer, &leveltext);
+		this->think =
+		    reinterpret_cast<int32_t (*)(void *, const tetris_bot_state *, tetris_bot_move *)>(
+			SDL_LoadFunction(this->handle, "tetris_bot_think"));
+		if (!this->think) {
+			SDL_UnloadObject(this->handle);
+			throw std::runtime_error(path + " does not export tetris_bot_think");
+		}
 
-		SDL_Rect livelevel = {
-		    .x = levelboard.x + (levelboard.w / 2) - levelModifier,
-		    .y = levelboard.y + (levelboard.h * 2 / 5),
-		    .w = (levelboard.w / (box_scale * 2)) * levelLength,
-		    .h = levelboard.h / 3,
-		};
-		SDL_RenderFillRect(renderer, &livelevel);
-		// End level board
+		// Both of these are optional
+		this->create = reinterpret_cast<void *(*)(void)>(
+		    SDL_LoadFunction(this->handle, "tetris_bot_create"));
+		this->destroy = reinterpret_cast<void (*)(void *)>(
+		    SDL_LoadFunction(this->handle, "tetris_bot_destroy"));
+	}
+
+	BotPlugin(const BotPlugin &) = delete;
+	BotPlugin &operator=(const BotPlugin &) = delete;
+
+	~BotPlugin()
+	{
+		if (!this->pinned) {
+			SDL_UnloadObject(this->handle);
+		}
+	}
+};
+
+// Drives one GameState with a bot.
+// The bot runs on its own thread, so a slow bot holds up its own board and nothing else.
+// The caller checks `busy` before moving the game along. The bot reads a copy of the board
+// rather than the game itself, so a bot that runs past its deadline can be left to finish
+// while the game goes on without it; its answer is thrown away when it comes.
+class BotDriver
+{
+      public:
+	BotPlugin *plugin;
+
+	// Milliseconds the bot gets per piece
+	unsigned int timeout;
+
+	// The number of answers thrown away for coming in late or failing
+	int forfeits = 0;
+
+	// The GameState::pieces the bot was last asked about
+	int asked = 0;
+
+	// Set between think() and the answer being played, or the deadline passing
+	bool busy = false;
+
+	BotDriver(BotPlugin *plugin, unsigned int timeout)
+	    : plugin(plugin), timeout(timeout), call(std::make_shared<Call>())
+	{
+		this->call->plugin = plugin;
+		this->call->timeout = timeout;
+		// Set up what the perfect clear search would otherwise allocate when the bot's
+		// thread first used it
+		PerfectClearSearch::spawned();
+		perfect_clears.allocate();
+		if (plugin->create) {
+			this->call->bot = plugin->create();
+		}
+		this->worker = std::thread([call = this->call] { work(call); });
+	}
+
+	BotDriver(const BotDriver &) = delete;
+	BotDriver &operator=(const BotDriver &) = delete;
+
+	~BotDriver()
+	{
+		auto &call = *this->call;
+		call.cancel = 1;
+		std::unique_lock<std::mutex> lock(call.mutex);
+		call.stop = true;
+		call.cv.notify_all();
+		if (call.running) {
+			// The bot is stuck inside a call. Leave it there; the thread cleans up
+			// after it if it ever returns.
+			lock.unlock();
+			this->plugin->pinned = true;
+			this->worker.detach();
+			return;
+		}
+		lock.unlock();
+		this->worker.join();
+	}
 
-		SDL_Rect reset_back = {
-		    .x = rightBorder + (this->block_size / 4),
-		    .y = (this->block_size) + (this->block_size * box_scale * 3),
-		    .w = (this->block_size * box_scale / 2) - this->block_size / 4,
-		    .h = reset_back.w,
+	// Asks the bot where the current piece should go, unless it already has been asked.
+	// A bot still busy with a call that ran out of time isn't asked anything until it
+	// returns. Never blocks.
+	void think(GameState &game)
+	{
+		if (this->busy || game.gameover || this->asked == game.pieces) {
+			return;
+		}
+		// Bots see the board through `rows`, which has room for this many columns
+		if (game.width > TETRIS_BOT_MAX_WIDTH) {
+			this->asked = game.pieces;
+			this->forfeit(game);
+			return;
+		}
+		auto &call = *this->call;
+		std::unique_lock<std::mutex> lock(call.mutex);
+		if (call.running) {
+			return;
+		}
+		lock.unlock();
+		this->asked = game.pieces;
+		make_room(call.board, game);
+		make_room(call.scratch, game);
+		call.board = game;
+
+		call.view = tetris_bot_state{
+		    .width = call.board.width,
+		    .height = call.board.height,
+		    .rows = call.board.rows.data(),
+		    .current = piece(call.board.block),
+		    .preview = piece(call.board.preview_block),
+		    .score = call.board.score,
+		    .level = call.board.level,
+		    .timeout = this->timeout,
+		    .perfect_clear = {},
 		};
-		SDL_RenderFillRect(renderer, &reset_back);
+		call.answer = tetris_bot_move{};
+		this->deadline =
+		    std::chrono::steady_clock::now() + std::chrono::milliseconds(this->timeout);
+
+		lock.lock();
+		this->busy = true;
+		call.running = true;
+		call.done = false;
+		call.cv.notify_all();
+	}
+
+	// Plays the bot's answer if it has come in, or gives up on it once the deadline has
+	// passed. Never blocks.
+	void poll(GameState &game)
+	{
+		if (!this->busy) {
+			return;
+		}
+		std::unique_lock<std::mutex> lock(this->call->mutex);
+		if (this->call->done) {
+			this->busy = false;
+			lock.unlock();
+			this->play(game);
+		} else if (std::chrono::steady_clock::now() > this->deadline) {
+			this->busy = false;
+			lock.unlock();
+			this->forfeit(game);
+		}
+	}
+
+	// Waits for the bot's answer and plays it, or gives up on it at the deadline
+	void wait(GameState &game)
+	{
+		if (!this->busy) {
+			return;
+		}
+		auto &call = *this->call;
+		std::unique_lock<std::mutex> lock(call.mutex);
+		bool done = call.cv.wait_until(lock, this->deadline, [&call] { return call.done; });
+		this->busy = false;
+		lock.unlock();
+		if (done) {
+			this->play(game);
+		} else {
+			this->forfeit(game);
+		}
+	}
 
-		SDL_Rect mute_back = {
-		    .x = rightBorder + (this->block_size / 2) + (this->block_size * box_scale / 2),
-		    .y = (this->block_size) + (this->block_size * box_scale * 3),
-		    .w = (this->block_size * box_scale / 2) - this->block_size / 4,
-		    .h = mute_back.w,
+      private:
+	// Everything the bot's thread uses. The thread holds on to it as well, so that it is
+	// still there for a bot that was stuck in a call when the driver went away.
+	struct Call {
+		BotPlugin *plugin = nullptr;
+		void *bot = nullptr;
+		unsigned int timeout = 0;
+
+		// A copy of the board the bot was asked about, which the view points into. It is
+		// only replaced once the bot has returned.
+		GameState board;
+		// Where the perfect clear search plays out what it finds
+		GameState scratch;
+		tetris_bot_state view;
+		tetris_bot_move answer;
+		int32_t status;
+		std::chrono::steady_clock::time_point finished;
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		bool done = false;
+		// Set while the bot is inside a call, which may go on past the deadline
+		bool running = false;
+		bool stop = false;
+		// Stops the perfect clear search when the driver goes away
+		std::atomic<uint64_t> cancel{0};
+	};
+
+	std::shared_ptr<Call> call;
+	std::chrono::steady_clock::time_point deadline;
+	std::thread worker;
+
+	static tetris_bot_piece piece(const Block &block)
+	{
+		return tetris_bot_piece{
+		    .cells = reinterpret_cast<const tetris_bot_cell *>(block.locations.data()),
+		    .cell_count = int32_t(block.locations.size()),
+		    .offset_x = block.offset_x,
+		    .offset_y = block.offset_y,
 		};
-		SDL_RenderFillRect(renderer, &mute_back);
+	}
 
-		for (auto &button : this->buttons) {
-			if (button.id == "replay") {
-				button.box = {
-				    .x = reset_back.x + (block_size / 3),
-				    .y = reset_back.y + (block_size / 3),
-				    .w = reset_back.w - (block_size / 2),
-				    .h = reset_back.h - (block_size / 2),
-				};
-			} else if (button.id == "mute" || button.id == "unmute") {
-				button.box = {
-				    .x = mute_back.x + (block_size / 3),
-				    .y = mute_back.y + (block_size / 3),
-				    .w = mute_back.w - (block_size / 2),
-				    .h = mute_back.h - (block_size / 2),
-				};
+	// Gives `board` room for all that a game the size of `game` can hold, so that copying
+	// one into it, or playing it on, never allocates. Only the first game of a size does.
+	static void make_room(GameState &board, const GameState &game)
+	{
+		board.rows.reserve(game.height);
+		board.skyline.reserve(game.width);
+		board.filled.reserve(game.width * game.height + Cells::capacity);
+		board.block_pool.reserve(block_shapes.size());
+	}
+
+	static void work(std::shared_ptr<Call> call)
+	{
+		TRACE_THREAD("bot");
+		std::unique_lock<std::mutex> lock(call->mutex);
+		while (true) {
+			call->cv.wait(lock, [&call] {
+				return call->stop || (call->running && !call->done);
+			});
+			if (call->stop) {
+				break;
 			}
+			lock.unlock();
+			offer_perfect_clear(*call);
+			TRACE_BEGIN("bot.think");
+			auto status = call->plugin->think(call->bot, &call->view, &call->answer);
+			TRACE_END();
+			auto finished = std::chrono::steady_clock::now();
+			lock.lock();
+			call->status = status;
+			call->finished = finished;
+			call->done = true;
+			call->running = false;
+			call->cv.notify_all();
+		}
+		lock.unlock();
+		if (call->plugin->destroy) {
+			call->plugin->destroy(call->bot);
+		}
+	}
 
-			if (button.id == "mute") {
-				if (this->mute) {
-					button.visible = false;
-				} else {
-					button.visible = true;
+	// Tells the bot how to clear the board, if there is a way with the tetrominos known.
+	// The search gets a quarter of the bot's time, so the bot is left most of it.
+	static void offer_perfect_clear(Call &call)
+	{
+		TRACE_BEGIN("bot.perfect_clear");
+		auto deadline = std::chrono::steady_clock::now() +
+				std::chrono::milliseconds(call.timeout) / 4;
+		auto clear =
+		    find_perfect_clear(call.board, deadline, call.cancel, 0, &call.scratch);
+		TRACE_END();
+		if (clear.found) {
+			call.view.perfect_clear = tetris_bot_perfect_clear{
+			    .pieces = clear.count,
+			    .rotations = clear.rotations[0],
+			    .x = clear.x[0],
+			};
+		}
+	}
+
+	// The piece goes straight down from wherever it is
+	void forfeit(GameState &game)
+	{
+		this->forfeits += 1;
+		game.drop();
+	}
+
+	void play(GameState &game)
+	{
+		if (this->call->status != 0 || this->call->finished > this->deadline) {
+			this->forfeit(game);
+			return;
+		}
+
+		auto &move = this->call->answer;
+		if (move.kind == TETRIS_BOT_PLACEMENT) {
+			for (int i = 0; i < (move.rotations % 4 + 4) % 4; ++i) {
+				game.rotate();
+			}
+			while (game.block.min_x() > move.x) {
+				auto x = game.block.offset_x;
+				game.left();
+				if (x == game.block.offset_x) {
+					break;
 				}
-			} else if (button.id == "unmute") {
-				if (this->mute) {
-					button.visible = true;
-				} else {
-					button.visible = false;
+			}
+			while (game.block.min_x() < move.x) {
+				auto x = game.block.offset_x;
+				game.right();
+				if (x == game.block.offset_x) {
+					break;
 				}
 			}
+			game.drop();
+			return;
+		}
 
-			if (button.visible) {
-				SDL_RenderFillRect(renderer, &button.box);
-				auto *texture =
-				    SDL_CreateTextureFromSurface(renderer, button.image);
-				SDL_RenderCopy(renderer, texture, nullptr, &button.box);
+		// Inputs only apply to the piece the bot was asked about
+		auto pieces = game.pieces;
+		auto count = std::min(std::max(move.input_count, 0), TETRIS_BOT_MAX_INPUTS);
+		for (int i = 0; i < count && game.pieces == pieces && !game.gameover; ++i) {
+			switch (move.inputs[i]) {
+			case TETRIS_BOT_LEFT:
+				game.left();
+				break;
+			case TETRIS_BOT_RIGHT:
+				game.right();
+				break;
+			case TETRIS_BOT_DOWN:
+				game.down();
+				break;
+			case TETRIS_BOT_ROTATE:
+				game.rotate();
+				break;
+			case TETRIS_BOT_DROP:
+				game.drop();
+				break;
+			default:
+				break;
 			}
 		}
+	}
+};
 
-		// Variable for the color white
-		SDL_Color White = {255, 255, 255, 255};
+// Searches for the best placement of the falling tetromino on a background thread.
+// Every request cancels the one before it. The latest finished answer can be read at any
+// time without waiting on the search.
+class HintSearch
+{
+      public:
+	// How many tetrominos ahead to look
+	int depth = 2;
 
-		// Write "SCORE"
-		SDL_Surface *scoreSurfaceMessage = TTF_RenderText_Solid(this->font, "SCORE", White);
-		SDL_Texture *scoreMessage =
-		    SDL_CreateTextureFromSurface(renderer, scoreSurfaceMessage);
-		SDL_RenderCopy(renderer, scoreMessage, NULL, &scoretext);
+	HintSearch()
+	{
+		this->worker = std::thread([this] { this->work(); });
+	}
 
-		// Write "LEVEL"
-		SDL_Surface *levelSurfaceMessage = TTF_RenderText_Solid(this->font, "LEVEL", White);
-		SDL_Texture *levelMessage =
-		    SDL_CreateTextureFromSurface(renderer, levelSurfaceMessage);
-		SDL_RenderCopy(renderer, levelMessage, NULL, &leveltext);
+	HintSearch(const HintSearch &) = delete;
+	HintSearch &operator=(const HintSearch &) = delete;
 
-		// Write updated score to screen
-		SDL_Surface *displayScore =
-		    TTF_RenderText_Solid(this->font, std::to_string(game.score).c_str(), White);
-		SDL_Texture *Message2 = SDL_CreateTextureFromSurface(renderer, displayScore);
-		SDL_RenderCopy(renderer, Message2, NULL, &livescore);
+	~HintSearch()
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->stop = true;
+			this->generation += 1;
+		}
+		this->cv.notify_all();
+		this->worker.join();
+	}
 
-		// Write updated level to screen
-		SDL_Surface *displayLevel =
-		    TTF_RenderText_Solid(this->font, std::to_string(game.level).c_str(), White);
-		SDL_Texture *liveLevelDisplay =
-		    SDL_CreateTextureFromSurface(renderer, displayLevel);
-		SDL_RenderCopy(renderer, liveLevelDisplay, NULL, &livelevel);
+	// Starts searching from `game`, abandoning any search still running
+	void request(const GameState &game)
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->snapshot = game;
+		this->generation += 1;
+		this->cv.notify_all();
+	}
 
-		if (!this->paused && !this->game.gameover) {
-			// Draw the falling tetromino
-			for (const auto &loc : game.block.coordinates()) {
-				SDL_Rect rect = {
-				    .x = loc.x * this->block_size + this->game_offset.x,
-				    .y = loc.y * this->block_size + this->game_offset.y,
-				    .w = this->block_size,
-				    .h = this->block_size,
-				};
+	// The best placement for the tetromino numbered `pieces` (see GameState::pieces),
+	// if the search for it has finished
+	Placement latest(int pieces)
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->fresh = false;
+		if (this->result_pieces != pieces) {
+			return Placement{};
+		}
+		return this->result;
+	}
 
-				SDL_SetRenderDrawColor(this->renderer, game.block.color.r,
-						       game.block.color.g, game.block.color.b, 255);
-				SDL_RenderFillRect(renderer, &rect);
-			}
+	// True when an answer has come in since the last call to latest()
+	bool ready()
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->fresh;
+	}
 
-			// Draw the shadow tetromino
-			SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
-			auto shadow = game.bottom(nullptr);
-			for (const auto &loc : shadow.coordinates()) {
-				SDL_Rect rect = {
-				    .x = loc.x * this->block_size + this->game_offset.x,
-				    .y = loc.y * this->block_size + this->game_offset.y,
-				    .w = this->block_size,
-				    .h = this->block_size,
-				};
+      private:
+	GameState snapshot;
+	std::atomic<uint64_t> generation{0};
+	Placement result;
+	int result_pieces = -1;
+	bool fresh = false;
+	bool stop = false;
 
-				SDL_SetRenderDrawColor(this->renderer, shadow.color.r,
-						       shadow.color.g, shadow.color.b, 100);
-				SDL_RenderFillRect(renderer, &rect);
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::thread worker;
+
+	void work()
+	{
+		TRACE_THREAD("hint");
+		uint64_t seen = 0;
+		std::unique_lock<std::mutex> lock(this->mutex);
+		while (true) {
+			this->cv.wait(lock, [&] { return this->stop || this->generation != seen; });
+			if (this->stop) {
+				return;
+			}
+			seen = this->generation;
+			GameState game = this->snapshot;
+			lock.unlock();
+
+			TRACE_BEGIN("hint.search");
+			Placement placement;
+			auto clear = find_perfect_clear(
+			    game, std::chrono::steady_clock::now() + perfect_clear_budget,
+			    this->generation, seen);
+			if (clear.found) {
+				placement = first_step(game, clear);
+			} else {
+				placement =
+				    best_placement(game, this->depth, this->generation, seen);
 			}
+			TRACE_END();
 
-			// Draw the filled blocks
-			for (const auto &loc : game.filled) {
-				SDL_Rect rect = {
-				    .x = loc.x * this->block_size + this->game_offset.x,
-				    .y = loc.y * this->block_size + this->game_offset.y,
-				    .w = this->block_size,
-				    .h = this->block_size,
-				};
-				auto rgb = loc.color;
-				SDL_SetRenderDrawColor(this->renderer, rgb.r, rgb.g, rgb.b, 255);
-				SDL_RenderFillRect(renderer, &rect);
+			lock.lock();
+			if (this->generation == seen) {
+				this->result = placement;
+				this->result_pieces = game.pieces;
+				this->fresh = true;
 			}
 		}
+	}
+};
 
-		// Draw Minigrid
-		SDL_Rect mg_back = {
-		    .x = rightBorder + (this->block_size / 4),
-		    .y = (this->block_size / 4 * 3) + (this->block_size * box_scale * 2),
-		    .w = this->block_size * box_scale,
-		    .h = this->block_size * box_scale,
-		};
-		SDL_SetRenderDrawColor(this->renderer, 0, 0, 0, 255);
-		SDL_RenderFillRect(renderer, &mg_back);
+// 64 side-by-side cells of one row of a CollabBoard
+struct Chunk {
+	uint64_t mask = 0;
+	RGB colors[64];
+};
 
-		for (const auto &loc : this->game.preview_block.locations) {
+// A row of a CollabBoard. Chunks are only allocated once something lands in them.
+struct Row {
+	// How many cells of the row are filled; the row is complete when this reaches the width
+	int count = 0;
+	vector<std::unique_ptr<Chunk>> chunks;
+};
 
-			// Used for when the preview box does not start in the upper left hand
-			// corner Takes the minimum x value and subtracts the lowest possible grid
-			// value (3) If the x is greater than 3, the multiplication will result in a
-			// number > 0 This will move the block to the upper left corner of the
-			// preview box.
-			auto widthModifier = (game.preview_block.min_x() - 3) * 2;
+// The board for collab mode, which can be thousands of blocks wide and tall.
+// Storage is sparse: empty rows and empty chunks of a row take no memory, so a mostly
+// empty board costs little no matter how big it is.
+class CollabBoard
+{
+      public:
+	int width;
+	int height;
 
-			// Converts the width and height of the block into pixels
-			auto blockWidth = (1 + widthModifier + game.preview_block.max_x() -
-					   game.preview_block.min_x()) *
-					  this->block_size;
-			auto blockHeight =
-			    (1 + game.preview_block.max_y() - game.preview_block.min_y()) *
-			    this->block_size;
+	// Rows that have been completed since the last call to clear_complete()
+	vector<int> complete;
 
-			// Designates the x and y coordinate of the preview box
-			auto preview_x = ((box_scale * this->block_size) - blockWidth) / 2;
-			auto preview_y = ((box_scale * this->block_size) - blockHeight) / 2;
+	CollabBoard(int width, int height)
+	    : width(width), height(height), rows(vector<std::unique_ptr<Row>>(height))
+	{
+	}
 
-			// Creates the rectangle for the preview box drawing
-			SDL_Rect rect = {
-			    .x = loc.x * this->block_size + mg_back.x + preview_x,
-			    .y = loc.y * this->block_size + mg_back.y + preview_y,
-			    .w = this->block_size,
-			    .h = this->block_size,
-			};
+	int chunk_count() { return (this->width + 63) / 64; }
+
+	// The row `y` rows from the top. Null rows are empty.
+	std::unique_ptr<Row> &row(int y) { return this->rows[(this->base + y) % this->height]; }
+
+	bool is_filled(int x, int y)
+	{
+		if (x < 0 || x >= this->width || y >= this->height) {
+			return true;
+		}
+		if (y < 0 || !this->row(y)) {
+			return false;
+		}
+		auto &chunk = this->row(y)->chunks[x / 64];
+		return chunk && (chunk->mask >> (x % 64)) & 1;
+	}
 
-			SDL_SetRenderDrawColor(this->renderer, this->game.preview_block.color.r,
-					       this->game.preview_block.color.g,
-					       this->game.preview_block.color.b, 255);
-			SDL_RenderFillRect(renderer, &rect);
+	void fill(int x, int y, RGB color)
+	{
+		if (x < 0 || x >= this->width || y < 0 || y >= this->height) {
+			return;
 		}
-		// End preview drawing
+		auto &row = this->row(y);
+		if (!row) {
+			row = std::make_unique<Row>();
+			row->chunks.resize(this->chunk_count());
+		}
+		auto &chunk = row->chunks[x / 64];
+		if (!chunk) {
+			chunk = std::make_unique<Chunk>();
+		}
+		auto bit = uint64_t(1) << (x % 64);
+		if (chunk->mask & bit) {
+			return;
+		}
+		chunk->mask |= bit;
+		chunk->colors[x % 64] = color;
+		row->count += 1;
+		if (row->count == this->width) {
+			this->complete.push_back(y);
+		}
+	}
 
-		std::string message;
-		if (this->game.gameover) {
-			Mix_HaltChannel(-1);
-			message = "GAME OVER";
-		} else if (this->paused) {
-			message = "PAUSED";
+	// Removes the completed rows, bringing everything above them down.
+	// Returns the number of rows removed.
+	//
+	// All of them go in one pass, which only moves row pointers and only those on one side of
+	// the completed rows: the rows above them move down, or, when the floor is nearer, the
+	// rows below move up and the ring is turned so they end up back where they were. The
+	// stack sits on the floor, so that is usually just the few rows under the ones cleared,
+	// however tall the board is.
+	int clear_complete()
+	{
+		auto &complete = this->complete;
+		int cleared = complete.size();
+		if (cleared == 0) {
+			return 0;
+		}
+		std::sort(complete.begin(), complete.end());
+		int top = complete.front();
+		int bottom = complete.back();
+		if (bottom + 1 <= this->height - top) {
+			int to = bottom;
+			int next = cleared - 1;
+			for (int from = bottom; from >= 0; --from) {
+				if (next >= 0 && complete[next] == from) {
+					next -= 1;
+					continue;
+				}
+				if (to != from) {
+					this->row(to) = std::move(this->row(from));
+				}
+				to -= 1;
+			}
+			for (; to >= 0; --to) {
+				this->row(to).reset();
+			}
 		} else {
-			message = "";
+			int to = top;
+			int next = 0;
+			for (int from = top; from < this->height; ++from) {
+				if (next < cleared && complete[next] == from) {
+					next += 1;
+					continue;
+				}
+				if (to != from) {
+					this->row(to) = std::move(this->row(from));
+				}
+				to += 1;
+			}
+			for (int y = to; y < this->height; ++y) {
+				this->row(y).reset();
+			}
+			// The emptied rows at the bottom come around to the top
+			this->base = (this->base + to) % this->height;
 		}
+		complete.clear();
+		return cleared;
+	}
 
-		SDL_Rect status_box = {
-		    .x = board.x + (this->block_size * 2),
-		    .y = board.h / 2 - this->height / 8,
-		    .w = board.w - (this->block_size * 4),
-		    .h = this->height / 8,
-		};
-		SDL_Surface *status_surface =
-		    TTF_RenderText_Solid(this->font, message.c_str(), White);
-		SDL_Texture *status_message =
-		    SDL_CreateTextureFromSurface(renderer, status_surface);
-		SDL_RenderCopy(renderer, status_message, NULL, &status_box);
+      private:
+	// A ring of rows, starting `base` from the front; see row()
+	vector<std::unique_ptr<Row>> rows;
+	int base = 0;
+};
 
-		SDL_SetRenderDrawColor(this->renderer, 84, 84, 84, 255);
-		SDL_RenderPresent(this->renderer);
+// A tetromino falling on a CollabBoard
+struct CollabPiece {
+	Block block;
+	unsigned int tickspeed;
+	Uint32 last_tick;
+	// The piece controlled from the keyboard, as opposed to the crowd
+	bool player = false;
+	// A crowd tetromino that found no room at the top is out of play, and tries again a tick
+	// later
+	bool waiting = false;
+};
+
+// Collab mode: one huge board shared by many tetrominos falling at once.
+// One of them is the player's; the rest are the crowd, which drift around on their own.
+// Each tick only touches the falling tetrominos and the rows they complete, so it costs
+// the same on any size of board.
+class CollabGame
+{
+      public:
+	CollabBoard board;
+	vector<CollabPiece> pieces;
+
+	int score = 0;
+	int lines = 0;
+	bool gameover = false;
+
+	uint64_t rng;
+
+	CollabGame(int width, int height, int crowd, uint64_t seed)
+	    : board(width, height), rng(seed)
+	{
+		auto now = SDL_GetTicks();
+		for (int i = 0; i <= crowd; ++i) {
+			CollabPiece piece{
+			    .block = Block(),
+			    .tickspeed = i == 0 ? 1000u : 50u + unsigned(this->random() % 200),
+			    .last_tick = now,
+			    .player = i == 0,
+			};
+			this->spawn(piece, this->random() % std::max(width - 3, 1));
+			this->pieces.push_back(piece);
+		}
 	}
 
-	~GameContext()
+	// splitmix64, same as GameState
+	uint64_t random()
 	{
-		Mix_FreeChunk(this->music);
-		SDL_DestroyRenderer(renderer);
-		SDL_DestroyWindow(window);
-		SDL_Quit();
+		uint64_t z = (this->rng += 0x9e3779b97f4a7c15);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+		return z ^ (z >> 31);
 	}
-};
 
-GameContext ctx;
-void do_loop() { ctx.loop(); }
+	CollabPiece &player() { return this->pieces[0]; }
+
+	// Puts a new random tetromino at the top of the board, near column x
+	void spawn(CollabPiece &piece, int x)
+	{
+		auto num = this->random() % block_shapes.size();
+		piece.block = Block();
+		piece.block.locations = block_shapes[num];
+		piece.block.color = block_colors[num];
+		piece.block.offset_x = std::clamp(x, 0, std::max(this->board.width - 4, 0));
+		piece.block.offset_y = 0;
+
+		// A crowd tetromino with no room where it landed tries somewhere else, and is left
+		// out of play if there is no room anywhere it tried
+		piece.waiting = false;
+		for (int tries = 0; !this->fits(piece.block, 0, 0); ++tries) {
+			if (tries == 8) {
+				this->gameover |= piece.player;
+				piece.waiting = !piece.player;
+				return;
+			}
+			piece.block.offset_x = this->random() % std::max(this->board.width - 3, 1);
+		}
+	}
+
+	bool fits(Block &block, int x, int y)
+	{
+		for (const auto &loc : block.coordinates()) {
+			if (this->board.is_filled(loc.x + x, loc.y + y)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool move(CollabPiece &piece, int x, int y)
+	{
+		if (!this->fits(piece.block, x, y)) {
+			return false;
+		}
+		piece.block.offset_x += x;
+		piece.block.offset_y += y;
+		return true;
+	}
+
+	void rotate(CollabPiece &piece)
+	{
+		Block rotated = piece.block;
+		rotated.rotate();
+		if (this->fits(rotated, 0, 0)) {
+			piece.block = rotated;
+		}
+	}
+
+	// Moves the tetromino down a row, locking it in place if it can't go any further
+	void down(CollabPiece &piece)
+	{
+		if (this->move(piece, 0, 1)) {
+			return;
+		}
+		for (const auto &loc : piece.block.coordinates()) {
+			this->board.fill(loc.x, loc.y, piece.block.color);
+		}
+		auto cleared = this->board.clear_complete();
+		this->lines += cleared;
+		this->score += cleared * cleared * 100;
+
+		auto x = piece.player ? piece.block.offset_x
+				      : int(this->random() % std::max(this->board.width - 3, 1));
+		this->spawn(piece, x);
+
+		// Tetrominos still falling where this one locked, or where the rows above the
+		// cleared ones came down, start over at the top
+		for (auto &other : this->pieces) {
+			if (&other != &piece && !other.waiting && !this->fits(other.block, 0, 0)) {
+				this->spawn(other, other.block.offset_x);
+			}
+		}
+	}
+
+	void drop(CollabPiece &piece)
+	{
+		while (this->move(piece, 0, 1)) {
+		}
+		this->down(piece);
+	}
+
+	// Applies gravity to every tetromino that is due for it
+	void tick(Uint32 now)
+	{
+		for (auto &piece : this->pieces) {
+			while (!this->gameover && now - piece.last_tick >= piece.tickspeed) {
+				piece.last_tick += piece.tickspeed;
+				if (piece.waiting) {
+					this->spawn(piece, this->random() %
+							       std::max(this->board.width - 3, 1));
+					continue;
+				}
+				if (!piece.player) {
+					// The crowd wanders a little on the way down
+					switch (this->random() % 8) {
+					case 0:
+						this->move(piece, -1, 0);
+						break;
+					case 1:
+						this->move(piece, 1, 0);
+						break;
+					case 2:
+						this->rotate(piece);
+						break;
+					default:
+						break;
+					}
+				}
+				this->down(piece);
+			}
+		}
+	}
+};
+
+// The part of a CollabBoard shown in the window
+struct Viewport {
+	// The board position at the top left corner of the window, in blocks
+	double x = 0;
+	double y = 0;
+
+	// Pixels per block
+	double scale = 20;
+
+	// Keep the player's tetromino in view
+	bool follow = true;
+};
+
+class Button
+{
+      public:
+	std::string id;
+	SDL_Rect box;
+	SDL_Surface *image;
+	bool visible = true;
+
+	// Where the image ended up in the Atlas
+	SDL_Rect source = {0, 0, 0, 0};
+
+	// Like SDL_PointInRect, the right and bottom edges are outside the box. A button that
+	// hasn't been laid out, as with more than one board, has an empty box and so is never
+	// clicked.
+	bool contains(int x, int y)
+	{
+		return x >= box.x && x < box.x + box.w && y >= box.y && y < box.y + box.h;
+	}
+};
+
+// Everything draw() puts on the screen, packed into a single texture: a white square for
+// filling rectangles, the font's printable characters, and the button images.
+// Because of this a whole frame, however many boards it has, goes to the renderer as one
+// batch (see Batch) rather than a draw call and a new texture per rectangle and string.
+class Atlas
+{
+      public:
+	SDL_Texture *texture = nullptr;
+	int width;
+	int height;
+
+	SDL_Rect white;
+	SDL_Rect glyphs[128] = {};
+
+	// Starts a sheet with just the white square in it. Until upload() the atlas is only a
+	// surface, so it can be filled in on any thread.
+	Atlas(int width = 1024, int height = 1024) : width(width), height(height)
+	{
+		this->sheet = SDL_CreateRGBSurfaceWithFormat(0, this->width, this->height, 32,
+							     SDL_PIXELFORMAT_RGBA32);
+		if (!this->sheet) {
+			throw SdlError("Failed to create the texture atlas");
+		}
+
+		this->white = this->place(4, 4);
+		SDL_FillRect(this->sheet, &this->white,
+			     SDL_MapRGBA(this->sheet->format, 255, 255, 255, 255));
+		// Sample the middle of the square, well away from its neighbours
+		this->white = {this->white.x + 1, this->white.y + 1, 2, 2};
+	}
+
+	Atlas(const Atlas &) = delete;
+	Atlas &operator=(const Atlas &) = delete;
+
+	~Atlas()
+	{
+		if (this->texture) {
+			SDL_DestroyTexture(this->texture);
+		}
+		if (this->sheet) {
+			SDL_FreeSurface(this->sheet);
+		}
+	}
+
+	// Adds the font's printable characters
+	void add_font(TTF_Font *font)
+	{
+		SDL_Color White = {255, 255, 255, 255};
+		for (int c = ' '; c < 127; ++c) {
+			SDL_Surface *glyph = TTF_RenderGlyph_Blended(font, c, White);
+			if (glyph) {
+				this->glyphs[c] = this->add(glyph);
+				SDL_FreeSurface(glyph);
+			}
+		}
+	}
+
+	// Copies an image in, returning where it went
+	SDL_Rect add(SDL_Surface *surface)
+	{
+		auto rect = this->place(surface->w, surface->h);
+		SDL_SetSurfaceBlendMode(surface, SDL_BLENDMODE_NONE);
+		SDL_BlitSurface(surface, nullptr, this->sheet, &rect);
+		return rect;
+	}
+
+	// Turns the sheet into the texture everything is drawn from
+	void upload(SDL_Renderer *renderer)
+	{
+		this->texture = SDL_CreateTextureFromSurface(renderer, this->sheet);
+		SDL_FreeSurface(this->sheet);
+		this->sheet = nullptr;
+		if (!this->texture) {
+			throw SdlError("Failed to create the texture atlas");
+		}
+		SDL_SetTextureBlendMode(this->texture, SDL_BLENDMODE_BLEND);
+	}
+
+	// The sheet's pixels, as RGBA bytes. Null once it has been uploaded.
+	const SDL_Surface *pixels() const { return this->sheet; }
+
+      private:
+	SDL_Surface *sheet = nullptr;
+
+	// Shelf packing: left to right, starting a new shelf when a row is full
+	int shelf_x = 0;
+	int shelf_y = 0;
+	int shelf_height = 0;
+
+	SDL_Rect place(int w, int h)
+	{
+		if (this->shelf_x + w > this->width) {
+			this->shelf_x = 0;
+			this->shelf_y += this->shelf_height + 1;
+			this->shelf_height = 0;
+		}
+		if (this->shelf_y + h > this->height) {
+			throw std::runtime_error("Texture atlas is full");
+		}
+		SDL_Rect rect = {this->shelf_x, this->shelf_y, w, h};
+		this->shelf_x += w + 1;
+		this->shelf_height = std::max(this->shelf_height, h);
+		return rect;
+	}
+};
+
+// Collects the rectangles, text and images of a frame, then draws them all with one
+// SDL_RenderGeometry call. Nothing is drawn until flush().
+class Batch
+{
+      public:
+	Atlas *atlas = nullptr;
+
+	vector<SDL_Vertex> vertices;
+	vector<int> indices;
+
+	void rect(const SDL_Rect &dst, SDL_Color color) { this->quad(dst, this->atlas->white, color); }
+
+	void image(const SDL_Rect &dst, const SDL_Rect &src)
+	{
+		this->quad(dst, src, SDL_Color{255, 255, 255, 255});
+	}
+
+	// The size `text` would be rendered at by TTF
+	SDL_Point measure(const char *text)
+	{
+		SDL_Point size = {0, 0};
+		for (auto *c = text; *c; ++c) {
+			auto &glyph = this->atlas->glyphs[*c & 127];
+			size.x += glyph.w;
+			size.y = std::max(size.y, glyph.h);
+		}
+		return size;
+	}
+
+	// Stretches the text to fill `box`, like rendering it with TTF and copying it over would
+	void text(const char *text, const SDL_Rect &box, SDL_Color color)
+	{
+		auto size = this->measure(text);
+		int w = size.x;
+		int h = size.y;
+		if (w == 0 || h == 0) {
+			return;
+		}
+
+		double scale = double(box.w) / w;
+		double x = box.x;
+		for (auto *c = text; *c; ++c) {
+			auto &glyph = this->atlas->glyphs[*c & 127];
+			SDL_Rect dst = {
+			    .x = int(x),
+			    .y = box.y,
+			    .w = int(x + glyph.w * scale) - int(x),
+			    .h = box.h * glyph.h / h,
+			};
+			this->quad(dst, glyph, color);
+			x += glyph.w * scale;
+		}
+	}
+
+	void flush(SDL_Renderer *renderer)
+	{
+		if (!this->indices.empty()) {
+			SDL_RenderGeometry(renderer, this->atlas->texture, this->vertices.data(),
+					   this->vertices.size(), this->indices.data(),
+					   this->indices.size());
+		}
+		this->vertices.clear();
+		this->indices.clear();
+	}
+
+      private:
+	void quad(const SDL_Rect &dst, const SDL_Rect &src, SDL_Color color)
+	{
+		float u0 = float(src.x) / this->atlas->width;
+		float v0 = float(src.y) / this->atlas->height;
+		float u1 = float(src.x + src.w) / this->atlas->width;
+		float v1 = float(src.y + src.h) / this->atlas->height;
+		float x0 = dst.x;
+		float y0 = dst.y;
+		float x1 = dst.x + dst.w;
+		float y1 = dst.y + dst.h;
+
+		int first = this->vertices.size();
+		this->vertices.push_back({{x0, y0}, color, {u0, v0}});
+		this->vertices.push_back({{x1, y0}, color, {u1, v0}});
+		this->vertices.push_back({{x1, y1}, color, {u1, v1}});
+		this->vertices.push_back({{x0, y1}, color, {u0, v1}});
+		for (int i : {0, 1, 2, 0, 2, 3}) {
+			this->indices.push_back(first + i);
+		}
+	}
+};
+
+// A frame drawn by the CPU rather than a renderer, for exporting replays on machines with
+// no display (--export). It draws a Batch the way SDL_RenderGeometry would: every quad is
+// an axis-aligned rectangle, either a solid fill (see fill_span and blend_span) or a
+// glyph or image sampled straight from the atlas, which must not have been uploaded.
+class Framebuffer
+{
+      public:
+	int width;
+	int height;
+
+	// RGBA bytes, a row at a time
+	vector<uint32_t> pixels;
+
+	Framebuffer(int width, int height)
+	    : width(width), height(height), pixels(vector<uint32_t>(width * height))
+	{
+	}
+
+	void clear(SDL_Color color)
+	{
+		fill_span(this->pixels.data(), this->pixels.size(), pack(color));
+	}
+
+	// Draws everything in the batch and empties it, like Batch::flush()
+	void draw(Batch &batch)
+	{
+		auto &atlas = *batch.atlas;
+		for (size_t i = 0; i + 3 < batch.vertices.size(); i += 4) {
+			auto &first = batch.vertices[i];
+			auto &last = batch.vertices[i + 2];
+			SDL_Rect dst = {
+			    .x = int(first.position.x),
+			    .y = int(first.position.y),
+			    .w = int(last.position.x) - int(first.position.x),
+			    .h = int(last.position.y) - int(first.position.y),
+			};
+			SDL_Rect src = {
+			    .x = int(std::lround(first.tex_coord.x * atlas.width)),
+			    .y = int(std::lround(first.tex_coord.y * atlas.height)),
+			    .w = int(std::lround(last.tex_coord.x * atlas.width)),
+			    .h = int(std::lround(last.tex_coord.y * atlas.height)),
+			};
+			src.w -= src.x;
+			src.h -= src.y;
+			if (src.x == atlas.white.x && src.y == atlas.white.y) {
+				this->fill(dst, first.color);
+			} else {
+				this->copy(dst, src, *atlas.pixels(), first.color);
+			}
+		}
+		batch.vertices.clear();
+		batch.indices.clear();
+	}
+
+	bool save_png(const std::string &path)
+	{
+		auto *surface = SDL_CreateRGBSurfaceWithFormatFrom(
+		    this->pixels.data(), this->width, this->height, 32, this->width * 4,
+		    SDL_PIXELFORMAT_RGBA32);
+		if (!surface) {
+			return false;
+		}
+		bool saved = IMG_SavePNG(surface, path.c_str()) == 0;
+		SDL_FreeSurface(surface);
+		return saved;
+	}
+
+      private:
+	static uint32_t pack(SDL_Color color)
+	{
+		return color.r | color.g << 8 | color.b << 16 | uint32_t(255) << 24;
+	}
+
+	// Clips `rect` to the frame, false if nothing is left of it
+	bool clip(SDL_Rect &rect)
+	{
+		SDL_Rect frame = {0, 0, this->width, this->height};
+		return SDL_IntersectRect(&rect, &frame, &rect);
+	}
+
+	void fill(SDL_Rect rect, SDL_Color color)
+	{
+		if (color.a == 0 || !this->clip(rect)) {
+			return;
+		}
+		for (int y = rect.y; y < rect.y + rect.h; ++y) {
+			auto *row = this->pixels.data() + y * this->width + rect.x;
+			if (color.a == 255) {
+				fill_span(row, rect.w, pack(color));
+			} else {
+				blend_span(row, rect.w, pack(color), color.a);
+			}
+		}
+	}
+
+	// Stretches `src` of the sheet over `dst`, nearest texel first, tinted by `color`
+	void copy(const SDL_Rect &dst, const SDL_Rect &src, const SDL_Surface &sheet,
+		  SDL_Color color)
+	{
+		SDL_Rect clipped = dst;
+		if (dst.w <= 0 || dst.h <= 0 || src.w <= 0 || src.h <= 0 || !this->clip(clipped)) {
+			return;
+		}
+		for (int y = clipped.y; y < clipped.y + clipped.h; ++y) {
+			int sy = src.y + (y - dst.y) * src.h / dst.h;
+			auto *texels =
+			    static_cast<const uint8_t *>(sheet.pixels) + sy * sheet.pitch;
+			auto *row = this->pixels.data() + y * this->width;
+			for (int x = clipped.x; x < clipped.x + clipped.w; ++x) {
+				auto *texel = texels + (src.x + (x - dst.x) * src.w / dst.w) * 4;
+				int alpha = texel[3] * color.a / 255;
+				if (alpha == 0) {
+					continue;
+				}
+				SDL_Color tinted = {
+				    Uint8(texel[0] * color.r / 255),
+				    Uint8(texel[1] * color.g / 255),
+				    Uint8(texel[2] * color.b / 255),
+				    255,
+				};
+				blend_span(row + x, 1, pack(tinted), alpha);
+			}
+		}
+	}
+};
+
+// Writes frames out as a YUV4MPEG2 stream (4:2:0, full range), which ffmpeg and most
+// players read as is. Consecutive frames of a game are mostly the same, so only the tiles
+// of 16 by 2 pixels that changed since the last frame are converted again.
+class Y4mWriter
+{
+      public:
+	Y4mWriter() = default;
+	Y4mWriter(const Y4mWriter &) = delete;
+	Y4mWriter &operator=(const Y4mWriter &) = delete;
+
+	~Y4mWriter() { this->close(); }
+
+	// Starts a stream at `path`, or on stdout for -. The size has to be even.
+	bool open(const std::string &path, int width, int height, int fps)
+	{
+		this->file = path == "-" ? stdout : std::fopen(path.c_str(), "wb");
+		if (!this->file) {
+			return false;
+		}
+		this->width = width;
+		this->height = height;
+		this->planes.assign(width * height + 2 * (width / 2) * (height / 2), 0);
+		this->last.clear();
+		std::fprintf(this->file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width,
+			     height, fps);
+		return !std::ferror(this->file);
+	}
+
+	bool write(const Framebuffer &frame)
+	{
+		int w = this->width;
+		for (int y = 0; y < this->height; y += 2) {
+			for (int x = 0; x < w; x += tile) {
+				int n = std::min(tile, w - x);
+				auto *top = frame.pixels.data() + y * w + x;
+				auto *bottom = top + w;
+				auto *last = this->last.data() + y * w + x;
+				if (!this->last.empty() && std::memcmp(top, last, n * 4) == 0 &&
+				    std::memcmp(bottom, last + w, n * 4) == 0) {
+					continue;
+				}
+				this->convert(top, bottom, x, y, n);
+			}
+		}
+		this->last = frame.pixels;
+
+		std::fputs("FRAME\n", this->file);
+		std::fwrite(this->planes.data(), 1, this->planes.size(), this->file);
+		return !std::ferror(this->file);
+	}
+
+	void close()
+	{
+		if (this->file && this->file != stdout) {
+			std::fclose(this->file);
+		} else if (this->file) {
+			std::fflush(this->file);
+		}
+		this->file = nullptr;
+	}
+
+      private:
+	static constexpr int tile = 16;
+
+	FILE *file = nullptr;
+	int width = 0;
+	int height = 0;
+
+	// The Y plane, then U and V at half the size each way
+	vector<uint8_t> planes;
+
+	// The frame before, to compare against
+	vector<uint32_t> last;
+
+	// Converts `n` pixels of the rows y and y + 1, starting at column x
+	void convert(const uint32_t *top, const uint32_t *bottom, int x, int y, int n)
+	{
+		int w = this->width;
+		uint8_t *y_plane = this->planes.data();
+		uint8_t *u_plane = y_plane + w * this->height;
+		uint8_t *v_plane = u_plane + (w / 2) * (this->height / 2);
+		for (int i = 0; i < n; i += 2) {
+			int r = 0, g = 0, b = 0;
+			for (int j = 0; j < 4; ++j) {
+				auto pixel = (j < 2 ? top : bottom)[i + j % 2];
+				int pr = pixel & 255;
+				int pg = (pixel >> 8) & 255;
+				int pb = (pixel >> 16) & 255;
+				y_plane[(y + j / 2) * w + x + i + j % 2] =
+				    (77 * pr + 150 * pg + 29 * pb + 128) >> 8;
+				r += pr;
+				g += pg;
+				b += pb;
+			}
+			// Averaged over the four pixels, which leaves the sums four times too big
+			int at = (y / 2) * (w / 2) + (x + i) / 2;
+			u_plane[at] =
+			    std::clamp((-43 * r - 85 * g + 128 * b + 512) / 1024 + 128, 0, 255);
+			v_plane[at] =
+			    std::clamp((128 * r - 107 * g - 21 * b + 512) / 1024 + 128, 0, 255);
+		}
+	}
+};
+
+// Lays out one game and its panels into a Batch: the board with the falling tetromino and
+// its shadow, the score, level and preview panels, and the buttons. The window draws its
+// boards with it (see GameContext::draw), and --export draws the same frames without one.
+class BoardView
+{
+      public:
+	Batch &batch;
+	FrameArena &arena;
+
+	bool paused = false;
+	bool mute = false;
+
+	// Laid out next to the board, if set
+	vector<Button> *buttons = nullptr;
+
+	// Where the hint search would put the falling tetromino, if anywhere
+	Placement hint;
+
+	// The best games so far, listed under GAME OVER if set. The game being drawn is
+	// highlighted if it is among them.
+	const ScoreRecord *leaders = nullptr;
+	size_t leader_count = 0;
+
+	BoardView(Batch &batch, FrameArena &arena) : batch(batch), arena(arena) {}
+
+	// Lays out `game` and its panels at `offset`.
+	// `height` is the height of the space the board has.
+	void draw(GameState &game, int block_size, Location offset, int height)
+	{
+		TRACE_BEGIN("draw.panels");
+
+		// The top of the space the board has, which the panels are placed from
+		int top = offset.y - block_size / 4;
+
+		// Number of digits in each statistic type
+
+		auto *score = this->arena.format("%d", game.score);
+		auto *level = this->arena.format("%d", game.level);
+		int scoreLength = strlen(score) - (game.score < 0);
+		int levelLength = strlen(level) - (game.level < 0);
+
+		if (scoreLength > 6) {
+			scoreLength = 6;
+		}
+		if (levelLength > 6) {
+			levelLength = 6;
+		}
+
+		// Left and right borders of the Tetris board
+		int rightBorder = offset.x + game.width * block_size;
+
+		SDL_Color Black = {0, 0, 0, 255};
+
+		SDL_Rect board_rect = {
+		    .x = offset.x,
+		    .y = offset.y,
+		    .w = game.width * block_size,
+		    .h = game.height * block_size,
+		};
+		this->batch.rect(board_rect, Black);
+
+		// Scoreboard
+		int box_scale = 5;
+
+		SDL_Rect scoreboard = {
+		    .x = rightBorder + (block_size / 4),
+		    .y = top + block_size / 4,
+		    .w = block_size * box_scale,
+		    .h = block_size * box_scale,
+		};
+		this->batch.rect(scoreboard, Black);
+
+		SDL_Rect scoretext = {
+		    .x = scoreboard.x + scoreboard.w / 6,
+		    .y = scoreboard.y,
+		    .w = (scoreboard.w * 2) / 3,
+		    .h = scoreboard.h / 3,
+		};
+
+		// How far the score needs to be pushed to the left
+		int modifier = scoreLength * (block_size / 4);
+		int levelModifier = levelLength * (block_size / 4);
+
+		SDL_Rect livescore = {
+		    .x = scoreboard.x + (scoreboard.w / 2) - modifier,
+		    .y = scoreboard.y + (scoreboard.h * 2 / 5),
+		    .w = (scoreboard.w / (box_scale * 2)) * scoreLength,
+		    .h = scoreboard.h / 3,
+		};
+		// End scoreboard
+
+		// Level board
+		SDL_Rect levelboard = {
+		    .x = rightBorder + (block_size / 4),
+		    .y = top + (block_size / 4 * 2) + (block_size * box_scale),
+		    .w = block_size * box_scale,
+		    .h = block_size * box_scale,
+		};
+		this->batch.rect(levelboard, Black);
+
+		SDL_Rect leveltext = {
+		    .x = levelboard.x + levelboard.w / 6,
+		    .y = levelboard.y,
+		    .w = (levelboard.w * 2) / 3,
+		    .h = scoreboard.h / 3,
+		};
+
+		SDL_Rect livelevel = {
+		    .x = levelboard.x + (levelboard.w / 2) - levelModifier,
+		    .y = levelboard.y + (levelboard.h * 2 / 5),
+		    .w = (levelboard.w / (box_scale * 2)) * levelLength,
+		    .h = levelboard.h / 3,
+		};
+		// End level board
+
+		if (this->buttons) {
+			SDL_Rect reset_back = {
+			    .x = rightBorder + (block_size / 4),
+			    .y = top + (block_size) + (block_size * box_scale * 3),
+			    .w = (block_size * box_scale / 2) - block_size / 4,
+			    .h = reset_back.w,
+			};
+			this->batch.rect(reset_back, Black);
+
+			SDL_Rect mute_back = {
+			    .x = rightBorder + (block_size / 2) + (block_size * box_scale / 2),
+			    .y = top + (block_size) + (block_size * box_scale * 3),
+			    .w = (block_size * box_scale / 2) - block_size / 4,
+			    .h = mute_back.w,
+			};
+			this->batch.rect(mute_back, Black);
+
+			for (auto &button : *this->buttons) {
+				if (button.id == "replay") {
+					button.box = {
+					    .x = reset_back.x + (block_size / 3),
+					    .y = reset_back.y + (block_size / 3),
+					    .w = reset_back.w - (block_size / 2),
+					    .h = reset_back.h - (block_size / 2),
+					};
+				} else if (button.id == "mute" || button.id == "unmute") {
+					button.box = {
+					    .x = mute_back.x + (block_size / 3),
+					    .y = mute_back.y + (block_size / 3),
+					    .w = mute_back.w - (block_size / 2),
+					    .h = mute_back.h - (block_size / 2),
+					};
+				}
+
+				if (button.id == "mute") {
+					if (this->mute) {
+						button.visible = false;
+					} else {
+						button.visible = true;
+					}
+				} else if (button.id == "unmute") {
+					if (this->mute) {
+						button.visible = true;
+					} else {
+						button.visible = false;
+					}
+				}
+
+				if (button.visible) {
+					this->batch.rect(button.box, Black);
+					// Nothing to show until the images are loaded
+					if (button.source.w) {
+						this->batch.image(button.box, button.source);
+					}
+				}
+			}
+		}
+
+		TRACE_END();
+
+		// Variable for the color white
+		SDL_Color White = {255, 255, 255, 255};
+
+		TRACE_BEGIN("draw.text");
+		// Write "SCORE"
+		this->batch.text("SCORE", scoretext, White);
+
+		// Write "LEVEL"
+		this->batch.text("LEVEL", leveltext, White);
+
+		// Write updated score to screen
+		this->batch.text(score, livescore, White);
+
+		// Write updated level to screen
+		this->batch.text(level, livelevel, White);
+		TRACE_END();
+
+		TRACE_BEGIN("draw.board");
+		if (!this->paused && !game.gameover) {
+			// Draw the falling tetromino
+			for (const auto &loc : game.block.coordinates()) {
+				SDL_Rect rect = {
+				    .x = loc.x * block_size + offset.x,
+				    .y = loc.y * block_size + offset.y,
+				    .w = block_size,
+				    .h = block_size,
+				};
+
+				auto rgb = game.block.color;
+				this->batch.rect(rect, SDL_Color{Uint8(rgb.r), Uint8(rgb.g),
+								 Uint8(rgb.b), 255});
+			}
+
+			// Draw the shadow tetromino
+			auto shadow = game.bottom(nullptr);
+			for (const auto &loc : shadow.coordinates()) {
+				SDL_Rect rect = {
+				    .x = loc.x * block_size + offset.x,
+				    .y = loc.y * block_size + offset.y,
+				    .w = block_size,
+				    .h = block_size,
+				};
+
+				auto rgb = shadow.color;
+				this->batch.rect(rect, SDL_Color{Uint8(rgb.r), Uint8(rgb.g),
+								 Uint8(rgb.b), 100});
+			}
+
+			// Draw the hint, a second shadow where the search would put the tetromino.
+			// It is gold when it is the way to a perfect clear.
+			if (this->hint.found) {
+				auto color = this->hint.perfect ? SDL_Color{255, 200, 0, 90}
+								: SDL_Color{255, 255, 255, 60};
+				for (const auto &loc : this->hint.block.coordinates()) {
+					SDL_Rect rect = {
+					    .x = loc.x * block_size + offset.x,
+					    .y = loc.y * block_size + offset.y,
+					    .w = block_size,
+					    .h = block_size,
+					};
+					this->batch.rect(rect, color);
+				}
+			}
+
+			// Draw the filled blocks
+			for (const auto &loc : game.filled) {
+				SDL_Rect rect = {
+				    .x = loc.x * block_size + offset.x,
+				    .y = loc.y * block_size + offset.y,
+				    .w = block_size,
+				    .h = block_size,
+				};
+				auto rgb = loc.color;
+				this->batch.rect(rect, SDL_Color{Uint8(rgb.r), Uint8(rgb.g),
+								 Uint8(rgb.b), 255});
+			}
+		}
+
+		TRACE_END();
+
+		// Draw Minigrid
+		TRACE_BEGIN("draw.preview");
+		SDL_Rect mg_back = {
+		    .x = rightBorder + (block_size / 4),
+		    .y = top + (block_size / 4 * 3) + (block_size * box_scale * 2),
+		    .w = block_size * box_scale,
+		    .h = block_size * box_scale,
+		};
+		this->batch.rect(mg_back, Black);
+
+		for (const auto &loc : game.preview_block.locations) {
+
+			// Used for when the preview box does not start in the upper left hand
+			// corner Takes the minimum x value and subtracts the lowest possible grid
+			// value (3) If the x is greater than 3, the multiplication will result in a
+			// number > 0 This will move the block to the upper left corner of the
+			// preview box.
+			auto widthModifier = (game.preview_block.min_x() - 3) * 2;
+
+			// Converts the width and height of the block into pixels
+			auto blockWidth = (1 + widthModifier + game.preview_block.max_x() -
+					   game.preview_block.min_x()) *
+					  block_size;
+			auto blockHeight =
+			    (1 + game.preview_block.max_y() - game.preview_block.min_y()) *
+			    block_size;
+
+			// Designates the x and y coordinate of the preview box
+			auto preview_x = ((box_scale * block_size) - blockWidth) / 2;
+			auto preview_y = ((box_scale * block_size) - blockHeight) / 2;
+
+			// Creates the rectangle for the preview box drawing
+			SDL_Rect rect = {
+			    .x = loc.x * block_size + mg_back.x + preview_x,
+			    .y = loc.y * block_size + mg_back.y + preview_y,
+			    .w = block_size,
+			    .h = block_size,
+			};
+
+			auto rgb = game.preview_block.color;
+			this->batch.rect(rect,
+					 SDL_Color{Uint8(rgb.r), Uint8(rgb.g), Uint8(rgb.b), 255});
+		}
+		// End preview drawing
+		TRACE_END();
+
+		TRACE_SCOPE("draw.status");
+		const char *message;
+		if (game.gameover) {
+			message = "GAME OVER";
+		} else if (this->paused) {
+			message = "PAUSED";
+		} else {
+			message = "";
+		}
+
+		SDL_Rect status_box = {
+		    .x = board_rect.x + (block_size * 2),
+		    .y = top + board_rect.h / 2 - height / 8,
+		    .w = board_rect.w - (block_size * 4),
+		    .h = height / 8,
+		};
+		this->batch.text(message, status_box, White);
+
+		if (game.gameover && this->leaders) {
+			int line = height / 24;
+			for (size_t i = 0; i < this->leader_count; ++i) {
+				auto &leader = this->leaders[i];
+				auto *text = this->arena.format("%d. %d", int(i + 1), leader.score);
+				auto size = this->batch.measure(text);
+				if (size.y == 0) {
+					break;
+				}
+				SDL_Rect box = {
+				    .x = status_box.x,
+				    .y = status_box.y + status_box.h + int(i) * line,
+				    .w = std::min(status_box.w, line * size.x / size.y),
+				    .h = line,
+				};
+				bool this_game = leader.seed == game.seed &&
+						 leader.score == game.score &&
+						 leader.pieces == game.pieces;
+				this->batch.text(text, box,
+						 this_game ? SDL_Color{255, 220, 0, 255} : White);
+			}
+		}
+	}
+};
+
+// Decodes the font, button images and music on a thread of its own, so the first frame
+// can be shown before any of them are ready. They come from assets.bundle when there is
+// one (see bundle.h), and straight from assets/ otherwise. Until ready(), the loader owns
+// everything below; after that it belongs to whoever takes it, and the loader frees
+// whatever is left when it is stopped.
+class AssetLoader
+{
+      public:
+	TTF_Font *font = nullptr;
+	Mix_Music *music = nullptr;
+
+	// The images asked for, and where each went in the atlas
+	vector<SDL_Surface *> images;
+	vector<SDL_Rect> sources;
+
+	// The font and the images, packed and ready to upload
+	Atlas *atlas = nullptr;
+
+	// Set when something couldn't be loaded
+	std::string error;
+
+	AssetLoader() = default;
+	AssetLoader(const AssetLoader &) = delete;
+	AssetLoader &operator=(const AssetLoader &) = delete;
+
+	~AssetLoader() { this->stop(); }
+
+	// Without `with_music`, audio is never touched. With it, the loader waits for
+	// allow_audio() before loading the music: the audio device is opened on the main thread,
+	// as SDL expects (and in the browser, the only thread with Web Audio).
+	void start(const vector<std::string> &image_names, bool with_music = true)
+	{
+		this->image_names = image_names;
+		this->with_music = with_music;
+#ifndef TETRIS_NO_THREADS
+		this->thread = std::thread([this]() {
+			TRACE_THREAD("assets");
+			this->load();
+		});
+#endif
+	}
+
+	// Whether everything has been loaded (or failed to)
+	bool ready()
+	{
+#ifdef TETRIS_NO_THREADS
+		// Nothing can run alongside, so load in the frame after the first one
+		if (!this->done && this->frames++ > 0) {
+			this->load();
+		}
+#endif
+		return this->done;
+	}
+
+	// Called once the main thread has tried to open the audio device; `opened` is whether
+	// it could
+	void allow_audio(bool opened)
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->audio_allowed = true;
+		this->audio_opened = opened;
+		this->wake.notify_one();
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->stopping = true;
+			this->wake.notify_one();
+		}
+		if (this->thread.joinable()) {
+			this->thread.join();
+		}
+		for (auto *image : this->images) {
+			SDL_FreeSurface(image);
+		}
+		this->images.clear();
+		if (this->font) {
+			TTF_CloseFont(this->font);
+			this->font = nullptr;
+		}
+		Mix_FreeMusic(this->music);
+		this->music = nullptr;
+		delete this->atlas;
+		this->atlas = nullptr;
+	}
+
+      private:
+	Bundle bundle;
+	vector<std::string> image_names;
+	bool with_music = true;
+	std::thread thread;
+	std::atomic<bool> done{false};
+	int frames = 0;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool audio_allowed = false;
+	bool audio_opened = false;
+	bool stopping = false;
+
+	SDL_RWops *open(const std::string &name)
+	{
+		const char *data;
+		size_t size;
+		if (this->bundle.find(name.c_str(), data, size)) {
+			return SDL_RWFromConstMem(data, size);
+		}
+		return SDL_RWFromFile(("assets/" + name).c_str(), "rb");
+	}
+
+	void load()
+	{
+		TRACE_SCOPE("load_assets");
+		{
+			StartupPhase phase("assets: bundle");
+			this->bundle.open("assets.bundle");
+		}
+		this->load_images();
+		if (this->with_music) {
+			this->load_music();
+		}
+		this->done = true;
+	}
+
+	void load_images()
+	{
+		{
+			StartupPhase phase("assets: ttf init");
+			if (TTF_Init() != 0) {
+				this->error = std::string("Failed to initialize SDL2_ttf: ") + SDL_GetError();
+				return;
+			}
+		}
+		{
+			// The font reads from the bundle as it goes, which is why the bundle stays open
+			StartupPhase phase("assets: font");
+			this->font = TTF_OpenFontRW(this->open("Sans.ttf"), 1, 14);
+			if (!this->font) {
+				this->error = std::string("Failed to load Sans.ttf: ") + SDL_GetError();
+				return;
+			}
+		}
+		try {
+			{
+				StartupPhase phase("assets: glyphs");
+				this->atlas = new Atlas();
+				this->atlas->add_font(this->font);
+			}
+			StartupPhase phase("assets: images");
+			for (const auto &name : this->image_names) {
+				auto *image = IMG_Load_RW(this->open(name), 1);
+				this->images.push_back(image);
+				this->sources.push_back(image ? this->atlas->add(image)
+							      : SDL_Rect{0, 0, 0, 0});
+			}
+		} catch (const std::exception &error) {
+			this->error = error.what();
+		}
+	}
+
+	// The music is streamed: only the compressed track is kept, and it is decoded a buffer at
+	// a time as it plays. Like the font, it reads from the bundle as it goes.
+	void load_music()
+	{
+		{
+			std::unique_lock<std::mutex> lock(this->mutex);
+			this->wake.wait(lock, [this]() { return this->audio_allowed || this->stopping; });
+			if (this->stopping || !this->audio_opened) {
+				// Play on without sound
+				return;
+			}
+		}
+		StartupPhase phase("assets: music");
+		for (const char *name : {"Korobeiniki.ogg", "Korobeiniki.wav"}) {
+			if (auto *source = this->open(name)) {
+				this->music = Mix_LoadMUS_RW(source, 1);
+				break;
+			}
+		}
+	}
+};
+
+// The keys that play one board
+struct Keymap {
+	SDL_Keycode left;
+	SDL_Keycode right;
+	SDL_Keycode down;
+	SDL_Keycode rotate;
+	SDL_Keycode drop;
+};
+
+// One keymap per player sharing the keyboard
+const vector<Keymap> keymaps = {
+    {SDLK_LEFT, SDLK_RIGHT, SDLK_DOWN, SDLK_UP, SDLK_SPACE},
+    {SDLK_a, SDLK_d, SDLK_s, SDLK_w, SDLK_LSHIFT},
+    {SDLK_j, SDLK_l, SDLK_k, SDLK_i, SDLK_RSHIFT},
+    {SDLK_KP_4, SDLK_KP_6, SDLK_KP_5, SDLK_KP_8, SDLK_KP_0},
+};
+
+// A game as it is kept in the session file. Everything is a fixed size, so a game can be
+// written into a file in place and read straight back out of it. Fields are in the
+// machine's own byte order; the file isn't meant to move between machines.
+struct SavedBlock {
+	int32_t x[Cells::capacity];
+	int32_t y[Cells::capacity];
+	int32_t count;
+	int32_t offset_x;
+	int32_t offset_y;
+	int32_t color[3];
+};
+
+struct SavedCell {
+	int16_t x;
+	int16_t y;
+	uint8_t color[3];
+	uint8_t padding;
+};
+
+struct SavedGame {
+	static const int max_pool = 7;
+	static const int max_cells = 1024;
+
+	uint64_t seed;
+	uint64_t rng;
+	int32_t score;
+	int32_t level;
+	int32_t level_left;
+	uint32_t tickspeed;
+	int32_t height;
+	int32_t width;
+	int32_t pieces;
+	int32_t gameover;
+
+	SavedBlock block;
+	SavedBlock preview;
+	int32_t pool_count;
+	SavedBlock pool[max_pool];
+
+	int32_t filled_count;
+	SavedCell filled[max_cells];
+};
+
+static_assert(std::is_trivially_copyable<SavedGame>::value, "SavedGame is copied as bytes");
+
+void save_block(const Block &block, SavedBlock &saved)
+{
+	saved = {};
+	saved.count = block.locations.size();
+	for (size_t i = 0; i < block.locations.size(); ++i) {
+		saved.x[i] = block.locations[i].x;
+		saved.y[i] = block.locations[i].y;
+	}
+	saved.offset_x = block.offset_x;
+	saved.offset_y = block.offset_y;
+	saved.color[0] = block.color.r;
+	saved.color[1] = block.color.g;
+	saved.color[2] = block.color.b;
+}
+
+bool restore_block(const SavedBlock &saved, Block &block)
+{
+	if (saved.count < 1 || saved.count > int(Cells::capacity)) {
+		return false;
+	}
+	block.locations = {};
+	for (int i = 0; i < saved.count; ++i) {
+		block.locations.push_back({saved.x[i], saved.y[i]});
+	}
+	block.offset_x = saved.offset_x;
+	block.offset_y = saved.offset_y;
+	block.color = {saved.color[0], saved.color[1], saved.color[2]};
+	return true;
+}
+
+// False when the game doesn't fit, in which case there is nothing worth saving
+bool save_game(const GameState &game, SavedGame &saved)
+{
+	if (game.block_pool.size() > SavedGame::max_pool ||
+	    game.filled.size() > SavedGame::max_cells) {
+		return false;
+	}
+	saved.seed = game.seed;
+	saved.rng = game.rng;
+	saved.score = game.score;
+	saved.level = game.level;
+	saved.level_left = game.level_left;
+	saved.tickspeed = game.tickspeed;
+	saved.height = game.height;
+	saved.width = game.width;
+	saved.pieces = game.pieces;
+	saved.gameover = game.gameover;
+
+	save_block(game.block, saved.block);
+	save_block(game.preview_block, saved.preview);
+	saved.pool_count = game.block_pool.size();
+	for (size_t i = 0; i < SavedGame::max_pool; ++i) {
+		if (i < game.block_pool.size()) {
+			save_block(game.block_pool[i], saved.pool[i]);
+		} else {
+			saved.pool[i] = {};
+		}
+	}
+
+	saved.filled_count = game.filled.size();
+	for (size_t i = 0; i < game.filled.size(); ++i) {
+		auto &cell = game.filled[i];
+		saved.filled[i] = {int16_t(cell.x),
+				   int16_t(cell.y),
+				   {uint8_t(cell.color.r), uint8_t(cell.color.g), uint8_t(cell.color.b)},
+				   0};
+	}
+	return true;
+}
+
+// Rebuilds a game from what save_game() kept. False, leaving `game` in an unspecified
+// state, when `saved` doesn't hold a sensible game.
+bool restore_game(const SavedGame &saved, GameState &game)
+{
+	if (saved.height < 1 || saved.height > 64 || saved.width < 1 || saved.width > 64 ||
+	    saved.pool_count < 0 || saved.pool_count > SavedGame::max_pool ||
+	    saved.filled_count < 0 || saved.filled_count > SavedGame::max_cells) {
+		return false;
+	}
+	game.set_size(saved.height, saved.width);
+	game.seed = saved.seed;
+	game.rng = saved.rng;
+	game.score = saved.score;
+	game.level = saved.level;
+	game.level_left = saved.level_left;
+	game.tickspeed = saved.tickspeed;
+	game.pieces = saved.pieces;
+	game.gameover = saved.gameover;
+
+	if (!restore_block(saved.block, game.block) ||
+	    !restore_block(saved.preview, game.preview_block)) {
+		return false;
+	}
+	game.block_pool.resize(saved.pool_count);
+	for (int i = 0; i < saved.pool_count; ++i) {
+		if (!restore_block(saved.pool[i], game.block_pool[i])) {
+			return false;
+		}
+	}
+
+	// The row masks and skyline follow from the filled cells
+	game.filled.clear();
+	for (int i = 0; i < saved.filled_count; ++i) {
+		auto &cell = saved.filled[i];
+		if (cell.x < 0 || cell.x >= game.width || cell.y < 0 || cell.y >= game.height) {
+			return false;
+		}
+		game.filled.push_back(
+		    {cell.x, cell.y, RGB{cell.color[0], cell.color[1], cell.color[2]}});
+		game.rows[cell.y] |= uint64_t(1) << cell.x;
+		game.skyline[cell.x] = std::min(game.skyline[cell.x], int(cell.y));
+	}
+	return true;
+}
+
+// The single-player game, kept in a file (--session) so closing the window doesn't lose it.
+// It is saved whenever a tetromino locks, and picked up again on the next start.
+//
+// The file holds two slots, each a SavedGame with a sequence number and a checksum. A save
+// always goes into the slot that doesn't hold the newest game, and is synced to disk before
+// the next save may touch the other one. Whatever happens in the middle of a save, the
+// newest slot with a good checksum is a complete game. Saving only hands the game to a
+// writer thread, so the simulation never waits on the disk.
+class Session
+{
+      public:
+	Session() = default;
+	Session(const Session &) = delete;
+	Session &operator=(const Session &) = delete;
+
+	~Session()
+	{
+		this->running = false;
+		this->wake.notify_one();
+		if (this->writer.joinable()) {
+			this->writer.join();
+		}
+	}
+
+	// Maps the session file, creating it if needed. False if it can't be used.
+	bool open(const char *path)
+	{
+		if (!this->file.create(path, file_size)) {
+			return false;
+		}
+		auto &header = this->header();
+		if (std::memcmp(header.magic, magic, sizeof(header.magic)) != 0 ||
+		    header.slot_size != sizeof(SavedGame)) {
+			// New, or from an incompatible version: start over
+			std::memset(this->file.data, 0, file_size);
+			std::memcpy(header.magic, magic, sizeof(header.magic));
+			header.slot_size = sizeof(SavedGame);
+			this->file.sync(0, file_size);
+		}
+
+		auto *newest = this->newest();
+		this->sequence = newest ? newest->sequence : 0;
+
+#ifndef TETRIS_NO_THREADS
+		this->running = true;
+		this->writer = std::thread(&Session::run, this);
+#endif
+		return true;
+	}
+
+	// Loads the saved game into `game`. False, leaving `game` alone, when there is no game
+	// to pick up again.
+	bool load(GameState &game)
+	{
+		auto *slot = this->newest();
+		if (!slot || slot->game.gameover) {
+			return false;
+		}
+		GameState restored;
+		if (!restore_game(slot->game, restored)) {
+			return false;
+		}
+		game = restored;
+		return true;
+	}
+
+	// Hands `game` over to be written. Doesn't wait for it to reach the disk.
+	void save(const GameState &game)
+	{
+		if (!this->file.data || !save_game(game, this->pending.write())) {
+			return;
+		}
+		this->pending.publish();
+#ifdef TETRIS_NO_THREADS
+		this->pending.update();
+		this->commit(this->pending.read());
+#else
+		// Not taking the lock: if the writer misses this, it looks again shortly anyway
+		this->wake.notify_one();
+#endif
+	}
+
+      private:
+	struct Slot {
+		uint64_t sequence;
+		uint64_t checksum;
+		SavedGame game;
+	};
+
+	struct Header {
+		char magic[8];
+		uint32_t slot_size;
+	};
+
+	static constexpr const char *magic = "TETRISS1";
+	static const size_t page = 4096;
+	static const size_t slot_offset = page;
+	static const size_t slot_stride = (sizeof(Slot) + page - 1) / page * page;
+	static const size_t file_size = slot_offset + 2 * slot_stride;
+
+	MappedFile file;
+	uint64_t sequence = 0;
+
+	TripleBuffer<SavedGame> pending;
+	std::thread writer;
+	std::atomic<bool> running{false};
+	std::mutex mutex;
+	std::condition_variable wake;
+
+	Header &header() { return *reinterpret_cast<Header *>(this->file.data); }
+
+	Slot &slot(int i)
+	{
+		return *reinterpret_cast<Slot *>(this->file.data + slot_offset + i * slot_stride);
+	}
+
+	// FNV-1a over the sequence number and the game
+	static uint64_t checksum(const Slot &slot)
+	{
+		uint64_t hash = 0xcbf29ce484222325;
+		auto add = [&](const void *data, size_t size) {
+			auto *bytes = static_cast<const unsigned char *>(data);
+			for (size_t i = 0; i < size; ++i) {
+				hash = (hash ^ bytes[i]) * 0x100000001b3;
+			}
+		};
+		add(&slot.sequence, sizeof(slot.sequence));
+		add(&slot.game, sizeof(slot.game));
+		return hash;
+	}
+
+	// The slot with the most recent complete save, if any
+	Slot *newest()
+	{
+		Slot *newest = nullptr;
+		for (int i = 0; i < 2; ++i) {
+			auto &slot = this->slot(i);
+			if (slot.sequence != 0 && slot.checksum == checksum(slot) &&
+			    (!newest || slot.sequence > newest->sequence)) {
+				newest = &slot;
+			}
+		}
+		return newest;
+	}
+
+	void commit(const SavedGame &game)
+	{
+		TRACE_SCOPE("session.commit");
+		// The slot the last save didn't go to
+		int i = (this->sequence + 1) % 2;
+		auto &slot = this->slot(i);
+		slot.game = game;
+		slot.sequence = this->sequence + 1;
+		slot.checksum = checksum(slot);
+		if (this->file.sync(slot_offset + i * slot_stride, sizeof(Slot))) {
+			this->sequence += 1;
+		}
+	}
+
+	void run()
+	{
+		TRACE_THREAD("session");
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(this->mutex);
+				this->wake.wait_for(lock, std::chrono::milliseconds(100));
+			}
+			// Anything handed over before stopping is still written
+			bool running = this->running;
+			if (this->pending.update()) {
+				this->commit(this->pending.read());
+			}
+			if (!running) {
+				break;
+			}
+		}
+	}
+};
+
+// The leaderboard (--scores), kept in a log file that records are only ever appended to.
+// The file is a header followed by ScoreRecords, each with a checksum. Reading skips over
+// anything that doesn't check out, whether torn by a crash or damaged in the middle, and
+// carries on from the next place a record does, so one bad record never costs the ones
+// after it.
+//
+// Several processes may share the file. Each takes an flock on it to append, and writes its
+// records whole in one go, so they never interleave.
+//
+// The best `kept` records are also kept in memory, in order, so rankings never need the
+// file. Since records are only ever added, a record that falls out of those can never get
+// back in, which is what compaction relies on: once the log has grown to `compact_at`
+// records, a thread of its own rewrites it, under the lock, with only the best of everything
+// in it. Records added in the meantime are held back and appended to the new log. Anyone
+// else waiting for the lock on the old log finds it replaced once they get it, and appends
+// to the new one instead.
+class ScoreStore
+{
+      public:
+	static constexpr size_t kept = 1000;
+	static constexpr size_t compact_at = 65536;
+	// Records held back until they are appended together
+	static constexpr size_t batch = 64;
+
+	ScoreStore() = default;
+	ScoreStore(const ScoreStore &) = delete;
+	ScoreStore &operator=(const ScoreStore &) = delete;
+
+	~ScoreStore()
+	{
+		if (this->compactor.joinable()) {
+			this->compactor.join();
+		}
+		if (this->log >= 0) {
+			this->flush();
+			::close(this->log);
+		}
+	}
+
+	// Reads the log at `path`, creating it if needed. False if it can't be used.
+	bool open(const std::string &path)
+	{
+		this->path = path;
+		this->log = ::open(path.c_str(), O_RDWR | O_APPEND | O_CREAT, 0644);
+		if (!this->lock()) {
+			return false;
+		}
+		MappedFile file;
+		bool ok = file.open(path.c_str());
+		if (ok && !scan(file, [this](const ScoreRecord &record) {
+			    rank(this->best, record);
+			    this->logged += 1;
+		    })) {
+			// From an incompatible version: start over
+			file.close();
+			ok = ftruncate(this->log, 0) == 0 && write_header(this->log);
+		}
+		this->unlock();
+		return ok;
+	}
+
+	// Adds a game to the leaderboard. Returns its place (1 for the best), or 0 if it isn't
+	// among the best `kept`. Doesn't wait for the disk; see flush().
+	int add(ScoreRecord record)
+	{
+		record.checksum = checksum(record);
+		std::unique_lock<std::mutex> lock(this->mutex);
+		this->pending.push_back(record);
+		this->logged += 1;
+		int place = rank(this->best, record);
+		if (!this->compacting && this->pending.size() >= batch) {
+			this->append();
+		}
+
+		if (this->compacting || this->logged < compact_at) {
+			return place;
+		}
+		this->compacting = true;
+		lock.unlock();
+#ifdef TETRIS_NO_THREADS
+		this->compact();
+#else
+		if (this->compactor.joinable()) {
+			this->compactor.join();
+		}
+		this->compactor = std::thread(&ScoreStore::compact, this);
+#endif
+		return place;
+	}
+
+	// Hands what was added so far to the operating system. During a compaction that is left
+	// to the compaction, which appends it as soon as the new log is in place.
+	void flush()
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if (!this->compacting) {
+			this->append();
+		}
+	}
+
+	// Copies the best `count` records into `out`, best first, and returns how many there were
+	size_t top(ScoreRecord *out, size_t count)
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		count = std::min(count, this->best.size());
+		std::copy(this->best.begin(), this->best.begin() + count, out);
+		return count;
+	}
+
+      private:
+	struct Header {
+		char magic[8];
+		uint32_t record_size;
+		uint32_t reserved;
+	};
+
+	static constexpr const char *magic = "TETRISH1";
+
+	std::string path;
+	int log = -1;
+	// Records in the log, as far as this process knows
+	size_t logged = 0;
+
+	// The best records, best first
+	vector<ScoreRecord> best;
+
+	std::mutex mutex;
+	std::thread compactor;
+	bool compacting = false;
+	// Added, but not in the log yet
+	vector<ScoreRecord> pending;
+
+	// FNV-1a over everything but the checksum
+	static uint64_t checksum(const ScoreRecord &record)
+	{
+		uint64_t hash = 0xcbf29ce484222325;
+		auto *bytes = reinterpret_cast<const unsigned char *>(&record);
+		for (size_t i = 0; i < offsetof(ScoreRecord, checksum); ++i) {
+			hash = (hash ^ bytes[i]) * 0x100000001b3;
+		}
+		return hash;
+	}
+
+	// Calls `found` with every record in `file` that checks out. After one that doesn't,
+	// it looks for the next one a byte further along each time. False if the file isn't a
+	// log of this version.
+	template <typename Found> static bool scan(const MappedFile &file, Found found)
+	{
+		if (file.size < sizeof(Header) ||
+		    std::memcmp(file.data, magic, sizeof(Header::magic)) != 0 ||
+		    reinterpret_cast<const Header *>(file.data)->record_size !=
+			sizeof(ScoreRecord)) {
+			return false;
+		}
+		ScoreRecord record;
+		for (size_t at = sizeof(Header); at + sizeof(record) <= file.size;) {
+			std::memcpy(&record, file.data + at, sizeof(record));
+			if (record.checksum == checksum(record)) {
+				found(record);
+				at += sizeof(record);
+			} else {
+				at += 1;
+			}
+		}
+		return true;
+	}
+
+	static bool write_all(int fd, const void *data, size_t size)
+	{
+		auto *bytes = static_cast<const char *>(data);
+		while (size > 0) {
+			ssize_t written = ::write(fd, bytes, size);
+			if (written <= 0) {
+				return false;
+			}
+			bytes += written;
+			size -= written;
+		}
+		return true;
+	}
+
+	static bool write_header(int fd)
+	{
+		Header header = {};
+		std::memcpy(header.magic, magic, sizeof(header.magic));
+		header.record_size = sizeof(ScoreRecord);
+		return write_all(fd, &header, sizeof(header));
+	}
+
+	// Takes the lock on the log. If another process's compaction replaced the file in the
+	// meantime, this moves to the one at `path` now and locks that instead. A new, empty
+	// log gets its header.
+	bool lock()
+	{
+		while (this->log >= 0 && flock(this->log, LOCK_EX) == 0) {
+			struct stat held;
+			struct stat named;
+			if (fstat(this->log, &held) != 0) {
+				break;
+			}
+			if (stat(this->path.c_str(), &named) == 0 && named.st_dev == held.st_dev &&
+			    named.st_ino == held.st_ino) {
+				if (held.st_size == 0 && !write_header(this->log)) {
+					break;
+				}
+				return true;
+			}
+			// Closing it drops the lock too
+			::close(this->log);
+			this->log = ::open(this->path.c_str(), O_RDWR | O_APPEND | O_CREAT, 0644);
+		}
+		if (this->log >= 0) {
+			this->unlock();
+		}
+		return false;
+	}
+
+	void unlock() { flock(this->log, LOCK_UN); }
+
+	// Appends the pending records in one write. Called with `mutex` held.
+	void append()
+	{
+		if (this->pending.empty()) {
+			return;
+		}
+		bool ok = this->lock();
+		if (ok) {
+			ok = write_all(this->log, this->pending.data(),
+				       this->pending.size() * sizeof(ScoreRecord));
+			this->unlock();
+		}
+		if (!ok) {
+			std::cerr << "Failed to add to the scores in " << this->path << std::endl;
+		}
+		this->pending.clear();
+	}
+
+	// Puts `record` in its place among `best`, if it has one there
+	static int rank(vector<ScoreRecord> &best, const ScoreRecord &record)
+	{
+		if (best.size() == kept && !ranks_above(record, best.back())) {
+			return 0;
+		}
+		auto at = std::upper_bound(best.begin(), best.end(), record, ranks_above);
+		int place = at - best.begin() + 1;
+		best.insert(at, record);
+		if (best.size() > kept) {
+			best.pop_back();
+		}
+		return place;
+	}
+
+	// Rewrites the log with just the best of what every process has logged, and what was
+	// pending here, then appends what is added while that is being written
+	void compact()
+	{
+		bool ok = this->lock();
+		vector<ScoreRecord> held;
+		if (ok) {
+			std::lock_guard<std::mutex> lock(this->mutex);
+			held.swap(this->pending);
+		}
+
+		vector<ScoreRecord> best;
+		MappedFile file;
+		ok = ok && file.open(this->path.c_str()) &&
+		     scan(file, [&best](const ScoreRecord &record) { rank(best, record); });
+		file.close();
+		for (const auto &record : held) {
+			rank(best, record);
+		}
+
+		auto temporary = this->path + ".tmp";
+		int out = ok ? ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+		ok = out >= 0 && write_header(out) &&
+		     write_all(out, best.data(), best.size() * sizeof(ScoreRecord)) &&
+		     fsync(out) == 0 && std::rename(temporary.c_str(), this->path.c_str()) == 0;
+		if (out >= 0) {
+			::close(out);
+		}
+		if (!ok) {
+			std::remove(temporary.c_str());
+			std::cerr << "Failed to compact the scores in " << this->path << std::endl;
+		}
+		// Whoever is waiting for the old log finds it replaced once they have the lock
+		if (this->log >= 0) {
+			this->unlock();
+		}
+
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if (ok) {
+			// The next append moves to the new log (see lock())
+			this->best = std::move(best);
+			for (const auto &record : this->pending) {
+				rank(this->best, record);
+			}
+			this->logged = this->best.size() + this->pending.size();
+		} else {
+			this->pending.insert(this->pending.begin(), held.begin(), held.end());
+		}
+		this->compacting = false;
+		this->append();
+	}
+};
+
+// A leaderboard entry for `game`, whose replay (if any) is being written by `recorder`
+ScoreRecord score_record(const GameState &game, const Recorder *recorder)
+{
+	ScoreRecord record = {};
+	record.seed = game.seed;
+	record.time = std::time(nullptr);
+	record.score = game.score;
+	record.level = game.level;
+	record.pieces = game.pieces;
+	record.finished = game.gameover;
+	if (recorder && recorder->path().size() < sizeof(record.replay)) {
+		std::memcpy(record.replay, recorder->path().data(), recorder->path().size());
+	}
+	return record;
+}
+
+// Writes every game event to a CSV file as it happens (--events). The file is written on a
+// thread of its own, so the games never wait for it.
+class EventLog
+{
+      public:
+	EventLog(const GameEvents &events, const std::string &path) : reader(events.subscribe())
+	{
+		this->file = std::fopen(path.c_str(), "w");
+		if (!this->file) {
+			std::cerr << "Failed to create the event log " << path << std::endl;
+			return;
+		}
+		std::fputs("board,event,rows,perfect,level,score,pieces\n", this->file);
+#ifndef TETRIS_NO_THREADS
+		this->running = true;
+		this->thread = std::thread(&EventLog::run, this);
+#endif
+	}
+
+	EventLog(const EventLog &) = delete;
+	EventLog &operator=(const EventLog &) = delete;
+
+	~EventLog()
+	{
+		this->running = false;
+		if (this->thread.joinable()) {
+			this->thread.join();
+		}
+		if (this->file) {
+			this->write();
+			std::fclose(this->file);
+		}
+		if (this->reader.missed) {
+			std::cerr << "The event log missed " << this->reader.missed << " events"
+				  << std::endl;
+		}
+	}
+
+	// Writes out the events so far, false if there were none. Without threads, whoever runs
+	// the games calls this.
+	bool write()
+	{
+		static const char *kinds[] = {"lock", "clear", "level", "topout"};
+		GameEvent event;
+		bool any = false;
+		while (this->file && this->reader.next(event)) {
+			std::fprintf(this->file, "%d,%s,%d,%d,%d,%d,%d\n", event.board,
+				     kinds[event.kind], event.rows, event.perfect, event.level,
+				     event.score, event.pieces);
+			any = true;
+		}
+		return any;
+	}
+
+      private:
+	GameEvents::Reader reader;
+	FILE *file = nullptr;
+	std::thread thread;
+	std::atomic<bool> running{false};
+
+	void run()
+	{
+		TRACE_THREAD("events");
+		// The ring only holds so many events, so keep up while they are coming in
+		while (this->running) {
+			if (!this->write()) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+	}
+};
+
+// One of the games shown in the window, played either from the keyboard or by a bot
+struct Board {
+	GameState game;
+
+	// Exactly one of these is set
+	const Keymap *keys = nullptr;
+	BotDriver *bot = nullptr;
+
+	// When gravity last moved the tetromino down
+	Uint32 last_time = 0;
+
+	// Set with --record
+	Recorder *recorder = nullptr;
+
+	// Whether the game has gone on the leaderboard
+	bool scored = false;
+
+	bool rotation_pressed = false;
+	bool space_pressed = false;
+};
+
+// Something for the simulation to act on, sent over from the thread that polls SDL
+struct Input {
+	enum Kind {
+		KeyDown,
+		KeyUp,
+		Reset,
+		Pause,
+		Resume,
+	} kind;
+	SDL_Keycode key;
+};
+
+// What a frame is drawn from: a copy of every game, as of the latest tick that changed one
+struct Snapshot {
+	vector<GameState> games;
+};
+
+// Runs the games at a fixed number of ticks per second, on a thread of its own.
+// Input comes in through `inputs`, and after every tick that changes anything a snapshot of
+// the games goes out through `snapshots`. Neither side waits for the other, so a slow
+// frame never holds back gravity or input, and the time the games see advances by exactly
+// one step per tick however the frames go. Without threads (the browser build) the render
+// loop calls advance() itself every frame.
+class Simulation
+{
+      public:
+	vector<Board> boards;
+
+	// Ticks per second
+	unsigned int rate = 250;
+
+	SpscQueue<Input, 256> inputs;
+	TripleBuffer<Snapshot> snapshots;
+
+	// What happens on every board, for anyone to subscribe to
+	GameEvents events;
+
+	// Where the first board is kept between runs, if anywhere
+	std::unique_ptr<Session> session;
+
+	// Where every board's games are ranked, if anywhere
+	std::unique_ptr<ScoreStore> scores;
+
+	Simulation() = default;
+	Simulation(const Simulation &) = delete;
+	Simulation &operator=(const Simulation &) = delete;
+
+	~Simulation()
+	{
+		this->stop();
+		for (auto &board : this->boards) {
+			delete board.bot;
+			delete board.recorder;
+		}
+	}
+
+	// Publishes the first snapshot and starts ticking
+	void start()
+	{
+		for (size_t i = 0; i < this->boards.size(); ++i) {
+			this->boards[i].game.outlet.events = &this->events;
+			this->boards[i].game.outlet.board = i;
+		}
+		this->publish();
+		this->next = std::chrono::steady_clock::now();
+#ifndef TETRIS_NO_THREADS
+		this->running = true;
+		this->thread = std::thread(&Simulation::run, this);
+#endif
+	}
+
+	void stop()
+	{
+		this->running = false;
+		if (this->thread.joinable()) {
+			this->thread.join();
+		}
+		// Keep whatever happened since the last lock too
+		if (this->session) {
+			this->session->save(this->boards[0].game);
+		}
+		this->event_log.reset();
+		for (auto &board : this->boards) {
+			if (board.recorder) {
+				board.recorder->flush();
+			}
+		}
+	}
+
+	// Records a replay of every game on every board into `dir`. Has to be called before
+	// start().
+	void record(const std::string &dir)
+	{
+		for (size_t i = 0; i < this->boards.size(); ++i) {
+			auto &board = this->boards[i];
+			board.recorder = new Recorder(dir, i);
+			board.game.recording.recorder = board.recorder;
+		}
+	}
+
+	// Ranks every game that ends on the leaderboard kept at `path`. Has to be called before
+	// start().
+	void keep_scores(const std::string &path)
+	{
+		auto scores = std::make_unique<ScoreStore>();
+		if (!scores->open(path)) {
+			std::cerr << "Failed to open the scores file " << path << std::endl;
+			return;
+		}
+		this->scores = std::move(scores);
+	}
+
+	// Writes the events of every board to `path` (see EventLog)
+	void log_events(const std::string &path)
+	{
+		this->event_log = std::make_unique<EventLog>(this->events, path);
+	}
+
+	// Keeps the first board in a session file, and picks up the game saved there if there
+	// is one. Has to be called before start().
+	void open_session(const std::string &path)
+	{
+		auto session = std::make_unique<Session>();
+		if (!session->open(path.c_str())) {
+			std::cerr << "Failed to open the session file " << path << std::endl;
+			return;
+		}
+		auto &game = this->boards[0].game;
+		if (session->load(game) && this->boards[0].recorder) {
+			this->boards[0].recorder->skip(game.seed);
+		}
+		this->saved_pieces = game.pieces;
+		this->saved_seed = game.seed;
+		this->session = std::move(session);
+	}
+
+	// Runs every tick that is due by `now`
+	void advance(std::chrono::steady_clock::time_point now)
+	{
+		auto step = std::chrono::microseconds(1000000 / this->rate);
+
+		// Rather than racing through minutes of ticks after the machine was suspended,
+		// give up on the missed time
+		if (now - this->next > std::chrono::seconds(1)) {
+			this->next = now;
+		}
+
+		while (this->next <= now) {
+			this->tick(step.count());
+			this->next += step;
+		}
+		if (this->changed) {
+			this->publish();
+			this->changed = false;
+		}
+
+#ifdef TETRIS_NO_THREADS
+		if (this->event_log) {
+			this->event_log->write();
+		}
+#endif
+
+		// Save whenever a tetromino has locked or a new game has started
+		auto &game = this->boards[0].game;
+		if (this->session &&
+		    (game.pieces != this->saved_pieces || game.seed != this->saved_seed)) {
+			this->session->save(game);
+			this->saved_pieces = game.pieces;
+			this->saved_seed = game.seed;
+		}
+	}
+
+      private:
+	// Simulated time in microseconds. It stands still while paused.
+	uint64_t time = 0;
+	std::chrono::steady_clock::time_point next;
+
+	bool paused = false;
+	bool changed = false;
+
+	// Set when a restart was asked for while a bot was still thinking
+	bool reset_pending = false;
+
+	// The game the session file was last told about
+	int saved_pieces = -1;
+	uint64_t saved_seed = 0;
+
+	std::unique_ptr<EventLog> event_log;
+
+	std::thread thread;
+	std::atomic<bool> running{false};
+
+	void run()
+	{
+		TRACE_THREAD("simulation");
+		while (this->running) {
+			this->advance(std::chrono::steady_clock::now());
+			std::this_thread::sleep_until(this->next);
+		}
+	}
+
+	void tick(uint64_t step)
+	{
+		TRACE_SCOPE("tick");
+		Input input;
+		while (this->inputs.pop(input)) {
+			this->handle(input);
+		}
+		if (this->paused) {
+			return;
+		}
+		this->time += step;
+		Uint32 now = this->time / 1000;
+		for (auto &board : this->boards) {
+			if (board.recorder) {
+				board.recorder->time = now;
+			}
+		}
+
+		for (auto &board : this->boards) {
+			if (board.bot && board.bot->busy) {
+				board.bot->poll(board.game);
+				this->changed |= !board.bot->busy;
+			}
+		}
+		if (this->reset_pending) {
+			this->reset();
+		}
+
+		for (auto &board : this->boards) {
+			if (board.bot) {
+				board.bot->think(board.game);
+			}
+
+			// Gravity waits while a bot is thinking, up to its timeout, so that the
+			// answer is about where the piece still is
+			auto &game = board.game;
+			if (now - board.last_time > game.tickspeed && !game.gameover &&
+			    !(board.bot && board.bot->busy)) {
+				game.fall();
+				// Keep to the beat, unless gravity was held back for longer than a tick
+				board.last_time += game.tickspeed;
+				if (now - board.last_time > game.tickspeed) {
+					board.last_time = now;
+				}
+				this->changed = true;
+			}
+			if (game.gameover) {
+				this->keep_score(board);
+			}
+		}
+	}
+
+	// Puts the board's game on the leaderboard, once. Games given up on count too, as long
+	// as they got anywhere.
+	void keep_score(Board &board)
+	{
+		auto &game = board.game;
+		if (!this->scores || board.scored || (!game.gameover && game.score == 0)) {
+			return;
+		}
+		this->scores->add(score_record(game, board.recorder));
+		this->scores->flush();
+		board.scored = true;
+	}
+
+	void handle(const Input &input)
+	{
+		switch (input.kind) {
+		case Input::KeyDown:
+			if (this->paused) {
+				break;
+			}
+			for (auto &board : this->boards) {
+				if (board.keys && !board.game.gameover) {
+					this->press(board, input.key);
+				}
+			}
+			break;
+		case Input::KeyUp:
+			for (auto &board : this->boards) {
+				if (!board.keys) {
+					continue;
+				}
+				if (input.key == board.keys->rotate) {
+					board.rotation_pressed = false;
+				} else if (input.key == board.keys->drop) {
+					board.space_pressed = false;
+				}
+			}
+			break;
+		case Input::Reset:
+			this->reset();
+			break;
+		case Input::Pause:
+			this->paused = true;
+			break;
+		case Input::Resume:
+			this->paused = false;
+			break;
+		}
+	}
+
+	// Plays a keypress on a board played from the keyboard
+	void press(Board &board, SDL_Keycode key)
+	{
+		auto &keys = *board.keys;
+		auto &game = board.game;
+		if (key == keys.right) {
+			game.right();
+		} else if (key == keys.left) {
+			game.left();
+		} else if (key == keys.down) {
+			game.down();
+		} else if (key == keys.rotate) {
+			if (!board.rotation_pressed) {
+				game.rotate();
+				board.rotation_pressed = true;
+			}
+		} else if (key == keys.drop) {
+			if (!board.space_pressed) {
+				game.drop();
+				board.space_pressed = true;
+			}
+		} else {
+			return;
+		}
+		this->changed = true;
+	}
+
+	void reset()
+	{
+		// A bot is thinking about its board; restart once it has answered or run out of
+		// time
+		for (auto &board : this->boards) {
+			if (board.bot && board.bot->busy) {
+				this->reset_pending = true;
+				return;
+			}
+		}
+		this->reset_pending = false;
+
+		auto seed = std::random_device{}();
+		for (auto &board : this->boards) {
+			this->keep_score(board);
+			board.scored = false;
+			GameState g(seed);
+			board.game = g;
+			if (board.bot) {
+				board.bot->asked = 0;
+			}
+		}
+		this->changed = true;
+	}
+
+	void publish()
+	{
+		TRACE_SCOPE("publish");
+		auto &snapshot = this->snapshots.write();
+		snapshot.games.resize(this->boards.size());
+		for (size_t i = 0; i < this->boards.size(); ++i) {
+			snapshot.games[i] = this->boards[i].game;
+		}
+		this->snapshots.publish();
+	}
+};
+
+class GameContext
+{
+      public:
+	// SDL values used for rendering the game
+	SDL_Window *window;
+	SDL_Surface *window_surface;
+	SDL_Renderer *renderer;
+
+	// The height and width of the game window
+	int height = 835;
+	int width = 645;
+
+	// The main font used for rendering text to the screen.
+	// Currently Sans.ttf. Null until the assets are loaded.
+	TTF_Font *font = nullptr;
+
+	// The x and y offsets for the position of the game itself.
+	// In most cases x will be determined by whatever makes the
+	// game centered and y will be zero.
+	Location game_offset;
+
+	// The games being played, each with an instance of GameState, which contains the
+	// inner-workings of the game. State for the game should not be stored elsewhere.
+	// Usually there is one; more are laid out in a grid (--boards). They belong to the
+	// simulation thread once it has started; frames are drawn from its snapshots.
+	Simulation sim;
+
+	// The song to be run in the background.
+	// Streamed from Korobeiniki.ogg
+	Mix_Music *music = nullptr;
+	// Its volume whenever it is not muted, both at start and after unmuting
+	static constexpr int music_volume = 50;
+
+	// Decodes the assets above while the first frames are shown
+	AssetLoader assets;
+
+	// Whether the assets have been taken over from the loader. Until then nothing else may
+	// touch SDL_mixer, which the loader may still be loading the music with.
+	bool loaded = false;
+
+	// When the context was set up, the first frame went up and the assets came into use,
+	// for --startup-profile
+	double created = 0;
+	double presented_at = 0;
+	double loaded_at = 0;
+	bool presented = false;
+
+	// The size (in pixels) of individual blocks.
+	// A tetromino consists of multiple blocks.
+	int block_size = double(height) * 0.05;
+	int paused = false;
+
+	// Current state within the loop
+	SDL_Event event;
+	bool redraw = true;
+	bool should_continue = true;
+	bool rotation_pressed = false;
+	bool space_pressed = false;
+
+	vector<Button> buttons;
+
+	bool mute = false;
+
+	// Every frame is drawn through these; see Atlas
+	Atlas *atlas;
+	Batch batch;
+
+	// Where `t` saves the trace to, in builds with tracing (see trace.h)
+	std::string trace_path = "trace.json";
+
+	// Shows where the falling tetromino would best go, toggled with `h`.
+	// The search runs on its own thread; see HintSearch.
+	HintSearch *hint = nullptr;
+
+	// The top of the leaderboard, read when the game is over
+	ScoreRecord leaders[5];
+	size_t leader_count = 0;
+
+	// Set in collab mode (--collab), which replaces `game` with one huge shared board
+	CollabGame *collab = nullptr;
+	Viewport view;
+
+	// What the hint search was last started from
+	int hint_pieces = -1;
+	Location hint_offset;
+	Cells hint_locations;
+
+	// Temporaries that only live until the end of the frame, like the text on screen
+	FrameArena arena;
+
+	// Set with --alloc-stats: print how often the heap was used per frame, once a second
+	bool alloc_stats = false;
+	Allocations alloc_total = {0, 0};
+	Uint32 alloc_report = 0;
+	int alloc_frames = 0;
+	uint64_t alloc_max = 0;
+
+	// Initializes SDL and the game state. Only video is set up here: the font, the images
+	// and audio are started on the asset loader's thread, while the window opens.
+	GameContext()
+	{
+		this->buttons = {
+		    Button{
+			.id = "replay",
+			.box =
+			    SDL_Rect{
+				.x = 0,
+				.y = 0,
+				.w = 0,
+				.h = 0,
+			    },
+			.image = nullptr,
+		    },
+		    Button{
+			.id = "mute",
+			.box =
+			    SDL_Rect{
+				.x = 0,
+				.y = 0,
+				.w = 0,
+				.h = 0,
+			    },
+			.image = nullptr,
+		    },
+		    Button{
+			.id = "unmute",
+			.box =
+			    SDL_Rect{
+				.x = 0,
+				.y = 0,
+				.w = 0,
+				.h = 0,
+			    },
+			.image = nullptr,
+		    },
+		};
+		vector<std::string> images;
+		for (const auto &button : this->buttons) {
+			images.push_back(button.id + ".png");
+		}
+		this->assets.start(images);
+
+		{
+			StartupPhase phase("sdl video");
+			if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+				throw SdlError("Failed to initialize SDL2");
+			}
+		}
+
+		{
+			StartupPhase phase("window");
+			this->window = SDL_CreateWindow("TETRIS", SDL_WINDOWPOS_CENTERED,
+							SDL_WINDOWPOS_CENTERED, this->width,
+							this->height, 0);
+			if (window == nullptr) {
+				throw SdlError("Failed to create window");
+			}
+			SDL_SetWindowResizable(window, SDL_TRUE);
+		}
+		{
+			StartupPhase phase("renderer");
+			this->renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+			if (renderer == nullptr) {
+				throw SdlError("Failed to create renderer");
+			}
+		}
+
+		Board board;
+		board.game.set_size(20, 10);
+		board.keys = &keymaps[0];
+		this->sim.boards = {board};
+
+		this->game_offset = {10, 10};
+
+		// Enough to draw the boards with until the real atlas is loaded
+		this->atlas = new Atlas(8, 8);
+		this->atlas->upload(this->renderer);
+		this->batch.atlas = this->atlas;
+	}
+
+	// Takes over the assets once the loader is done with them, and starts the music
+	void finish_loading()
+	{
+		TRACE_SCOPE("finish_loading");
+		auto &assets = this->assets;
+		this->loaded = true;
+		if (!assets.error.empty()) {
+			std::cerr << assets.error << std::endl;
+			this->should_continue = false;
+			return;
+		}
+
+		{
+			StartupPhase phase("atlas upload");
+			assets.atlas->upload(this->renderer);
+		}
+		delete this->atlas;
+		this->atlas = assets.atlas;
+		this->batch.atlas = this->atlas;
+		assets.atlas = nullptr;
+
+		this->font = assets.font;
+		assets.font = nullptr;
+		this->music = assets.music;
+		assets.music = nullptr;
+		for (size_t i = 0; i < this->buttons.size(); ++i) {
+			this->buttons[i].image = assets.images[i];
+			this->buttons[i].source = assets.sources[i];
+		}
+		assets.images.clear();
+
+		Mix_VolumeMusic(this->mute ? 0 : music_volume);
+		Mix_PlayMusic(this->music, -1);
+		if (this->paused) {
+			Mix_PauseMusic();
+		}
+		this->redraw = true;
+
+		this->loaded_at = since_start();
+		this->print_startup();
+	}
+
+	// Shows the frame, noting when the first one went up. Then audio is started, so that
+	// opening the device doesn't hold up the first frame.
+	void present()
+	{
+		SDL_RenderPresent(this->renderer);
+		if (!this->presented) {
+			this->presented_at = since_start();
+			startup.record("first frame", this->created, this->presented_at);
+			this->presented = true;
+			this->open_audio();
+			this->print_startup();
+		}
+	}
+
+	// Opens the audio device here on the main thread, and lets the loader load the music
+	// for it
+	void open_audio()
+	{
+		StartupPhase phase("audio init");
+		bool opened = SDL_InitSubSystem(SDL_INIT_AUDIO) == 0;
+		if (opened) {
+			Mix_Init(MIX_INIT_OGG);
+			opened = Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048) == 0;
+		}
+		this->assets.allow_audio(opened);
+	}
+
+	// Prints the startup profile once there is both something on screen and the assets
+	// to play with
+	void print_startup()
+	{
+		if (this->presented && this->loaded && startup.enabled) {
+			startup.print();
+			fprintf(stderr, "startup: first frame at %.1f ms, assets in use at %.1f ms\n",
+				this->presented_at, this->loaded_at);
+		}
+	}
+
+	// Replaces the board with `count` of them. The first `players` are played from the
+	// keyboard, each with its own keymap, and the rest by the given bots in turn.
+	// Every board gets the same tetrominos in the same order.
+	void set_boards(int count, int players, const vector<std::unique_ptr<BotPlugin>> &bots,
+			unsigned int timeout, uint64_t seed)
+	{
+		auto &boards = this->sim.boards;
+		for (auto &board : boards) {
+			delete board.bot;
+		}
+		boards.clear();
+		boards.reserve(count);
+
+		for (int i = 0; i < count; ++i) {
+			Board board;
+			board.game = GameState(seed);
+			if (i < players) {
+				board.keys = &keymaps[i];
+			} else {
+				auto &plugin = bots[(i - players) % bots.size()];
+				board.bot = new BotDriver(plugin.get(), timeout);
+			}
+			boards.push_back(board);
+		}
+
+		// Keep every board the usual shape
+		int columns, rows;
+		this->grid(columns, rows);
+		this->width = this->height / 1.295 * columns / rows;
+		SDL_SetWindowSize(this->window, this->width, this->height);
+	}
+
+	// The number of columns and rows of boards. Boards are never added or removed once the
+	// simulation has started, so this is safe to ask from any thread.
+	void grid(int &columns, int &rows)
+	{
+		int count = this->sim.boards.size();
+		columns = std::ceil(std::sqrt(count));
+		rows = (count + columns - 1) / columns;
+	}
+
+	void resize(int w, int h)
+	{
+		int columns, rows;
+		this->grid(columns, rows);
+		double aspect = 1.295 * rows / columns;
+
+		// Proportionally resize based on height first, then width
+		if (h != this->height) {
+			this->height = h;
+			this->width = height / aspect;
+		} else if (w != this->width) {
+			this->width = w;
+			this->height = width * aspect;
+		}
+		SDL_SetWindowSize(this->window, width, height);
+		this->block_size = double(this->height - this->game_offset.y) * 0.05;
+		this->game_offset = {this->block_size / 4, this->block_size / 4};
+	}
+
+	void pause()
+	{
+		this->paused = true;
+		this->send({Input::Pause, 0});
+		if (this->loaded) {
+			Mix_PauseMusic();
+		}
+	}
+
+	void resume()
+	{
+		this->paused = false;
+		this->send({Input::Resume, 0});
+		if (this->loaded) {
+			Mix_ResumeMusic();
+		}
+	}
+
+	// Passes an input on to the simulation. It drains the queue every tick, so it can only
+	// be full if the simulation has stalled; the input is dropped then.
+	void send(const Input &input)
+	{
+		if (!this->sim.inputs.push(input)) {
+			std::cerr << "Simulation is not keeping up, dropped an input" << std::endl;
+		}
+	}
+
+	void set_mute(bool mute)
+	{
+		this->mute = mute;
+		if (this->loaded) {
+			Mix_VolumeMusic(mute ? 0 : music_volume);
+		}
+	}
+
+	void reset()
+	{
+		this->send({Input::Reset, 0});
+		if (this->loaded) {
+			// Starts the song over from the beginning, replacing what was playing
+			Mix_PlayMusic(this->music, -1);
+		}
+	}
+
+	void loop()
+	{
+		if (!this->loaded && this->assets.ready()) {
+			this->finish_loading();
+		}
+		auto before = allocations;
+		this->frame();
+		this->arena.reset();
+		if (this->alloc_stats) {
+			this->count_allocations(before);
+		}
+	}
+
+	// Adds up the heap use of this frame, and reports it once a second. A steady frame
+	// should make no allocations at all; anything short-lived belongs in `arena`.
+	void count_allocations(Allocations before)
+	{
+		auto count = allocations.count - before.count;
+		this->alloc_total.count += count;
+		this->alloc_total.bytes += allocations.bytes - before.bytes;
+		this->alloc_max = std::max(this->alloc_max, count);
+		this->alloc_frames += 1;
+
+		auto now = SDL_GetTicks();
+		if (now - this->alloc_report < 1000) {
+			return;
+		}
+		fprintf(stderr,
+			"%d frames: %.2f allocations (%.0f bytes) per frame, at most %llu; arena "
+			"high water %zu bytes\n",
+			this->alloc_frames, double(this->alloc_total.count) / this->alloc_frames,
+			double(this->alloc_total.bytes) / this->alloc_frames,
+			(unsigned long long)this->alloc_max, this->arena.high_water);
+		this->alloc_total = {0, 0};
+		this->alloc_report = now;
+		this->alloc_frames = 0;
+		this->alloc_max = 0;
+	}
+
+	void frame()
+	{
+		TRACE_SCOPE("loop");
+		TRACE_BEGIN("poll");
+		SDL_PollEvent(&this->event);
+		TRACE_END();
+
+		if (this->paused) {
+			if (this->event.type == SDL_WINDOWEVENT &&
+			    this->event.window.event == SDL_WINDOWEVENT_FOCUS_GAINED) {
+			} else {
+				return;
+			}
+		}
+
+		if (this->collab) {
+			this->collab_loop();
+			return;
+		}
+
+		TRACE_BEGIN("events");
+		switch (this->event.type) {
+		case SDL_QUIT:
+			this->should_continue = false;
+			break;
+		case SDL_KEYDOWN:
+			this->send({Input::KeyDown, this->event.key.keysym.sym});
+			// Unconditional keypresses
+			switch (this->event.key.keysym.sym) {
+			case SDLK_r:
+				this->reset();
+				break;
+			case SDLK_m:
+				this->set_mute(!this->mute);
+				break;
+			case SDLK_t:
+				trace::dump(this->trace_path);
+				break;
+			case SDLK_h:
+				if (this->hint) {
+					delete this->hint;
+					this->hint = nullptr;
+				} else {
+					this->hint = new HintSearch();
+					this->hint_pieces = -1;
+				}
+				this->redraw = true;
+				break;
+			default:
+				break;
+			}
+			break;
+		case SDL_KEYUP:
+			this->send({Input::KeyUp, this->event.key.keysym.sym});
+			break;
+		case SDL_WINDOWEVENT:
+			this->redraw = true;
+			switch (this->event.window.event) {
+			case SDL_WINDOWEVENT_FOCUS_LOST:
+				this->pause();
+				break;
+			case SDL_WINDOWEVENT_FOCUS_GAINED:
+				this->resume();
+				break;
+			case SDL_WINDOWEVENT_RESIZED:
+				int w, h;
+				SDL_GetWindowSize(this->window, &w, &h);
+				this->resize(w, h);
+				break;
+			}
+			break;
+		case SDL_MOUSEBUTTONUP:
+			if (this->event.button.button == SDL_BUTTON_LEFT) {
+				auto x = this->event.button.x;
+				auto y = this->event.button.y;
+				for (auto &button : this->buttons) {
+					if (button.contains(x, y) && button.visible) {
+						this->redraw = true;
+						if (button.id == "replay") {
+							this->reset();
+							break;
+						}
+						if (button.id == "unmute") {
+							this->set_mute(false);
+							break;
+						}
+						if (button.id == "mute") {
+							this->set_mute(true);
+							break;
+						}
+					}
+				}
+			}
+			break;
+		default:
+			break;
+		}
+		TRACE_END();
+
+#ifdef TETRIS_NO_THREADS
+		this->sim.advance(std::chrono::steady_clock::now());
+#endif
+		this->redraw |= this->sim.snapshots.update();
+
+		if (this->hint) {
+			TRACE_SCOPE("hint");
+			this->update_hint();
+		}
+
+		if (this->redraw) {
+			this->draw();
+			TRACE_SCOPE("update_window");
+			SDL_UpdateWindowSurface(this->window);
+			this->redraw = false;
+		}
+	}
+
+	// Restarts the hint search whenever the falling tetromino moves, rotates or locks.
+	// Hints are for the first board only.
+	void update_hint()
+	{
+		auto &game = this->sim.snapshots.read().games[0];
+		auto &block = game.block;
+		if (game.gameover) {
+			return;
+		}
+		if (this->hint_pieces != game.pieces || this->hint_offset.x != block.offset_x ||
+		    this->hint_offset.y != block.offset_y ||
+		    this->hint_locations.size() != block.locations.size() ||
+		    !std::equal(block.locations.begin(), block.locations.end(),
+				this->hint_locations.begin(), [](const auto &a, const auto &b) {
+					return a.x == b.x && a.y == b.y;
+				})) {
+			this->hint_pieces = game.pieces;
+			this->hint_offset = {block.offset_x, block.offset_y};
+			this->hint_locations = block.locations;
+			this->hint->request(game);
+		}
+		if (this->hint->ready()) {
+			this->redraw = true;
+		}
+	}
+
+	void draw()
+	{
+		TRACE_SCOPE("draw");
+
+		// Set SDL screen to gray
+		SDL_SetRenderDrawColor(this->renderer, 84, 84, 84, 255);
+		SDL_RenderClear(this->renderer);
+
+		auto &games = this->sim.snapshots.read().games;
+		bool gameover = true;
+		for (const auto &game : games) {
+			gameover &= game.gameover;
+		}
+
+		// The game is on the leaderboard by the time it shows as over, so the board can
+		// be read once then
+		if (!gameover) {
+			this->leader_count = 0;
+		} else if (this->sim.scores && this->leader_count == 0) {
+			this->leader_count =
+			    this->sim.scores->top(this->leaders, std::size(this->leaders));
+		}
+		if (gameover && this->loaded && Mix_PlayingMusic()) {
+			Mix_HaltMusic();
+		}
+
+		if (games.size() == 1) {
+			this->draw_board(games[0], this->block_size, this->game_offset, this->height,
+					 true);
+		} else {
+			// Each board gets a smaller copy of the usual layout
+			int columns, rows;
+			this->grid(columns, rows);
+			int cell_w = this->width / columns;
+			int cell_h = this->height / rows;
+			int block_size = std::max(1, int(std::min(cell_h * 0.05, cell_w / 15.75)));
+			for (size_t i = 0; i < games.size(); ++i) {
+				Location offset = {
+				    int(i % columns) * cell_w + block_size / 4,
+				    int(i / columns) * cell_h + block_size / 4,
+				};
+				this->draw_board(games[i], block_size, offset, cell_h, false);
+			}
+		}
+
+		TRACE_SCOPE("draw.present");
+		this->batch.flush(this->renderer);
+		this->present();
+	}
+
+	// Lays out one game and its panels at `offset` into the batch; see BoardView.
+	// `height` is the height of the space the board has. The buttons only come with the
+	// board when `controls` is set.
+	void draw_board(GameState &game, int block_size, Location offset, int height, bool controls)
+	{
+		BoardView board(this->batch, this->arena);
+		board.paused = this->paused;
+		board.mute = this->mute;
+		if (controls) {
+			board.buttons = &this->buttons;
+		}
+		if (this->hint && !this->paused && !game.gameover &&
+		    &game == &this->sim.snapshots.read().games[0]) {
+			board.hint = this->hint->latest(game.pieces);
+		}
+		if (controls && this->leader_count) {
+			board.leaders = this->leaders;
+			board.leader_count = this->leader_count;
+		}
+		board.draw(game, block_size, offset, height);
+	}
+
+	// loop() for collab mode. The crowd is always moving, so every frame is drawn.
+	void collab_loop()
+	{
+		auto &collab = *this->collab;
+		auto &player = collab.player();
+
+		switch (this->event.type) {
+		case SDL_QUIT:
+			this->should_continue = false;
+			break;
+		case SDL_KEYDOWN:
+			switch (this->event.key.keysym.sym) {
+			case SDLK_RIGHT:
+				collab.move(player, 1, 0);
+				break;
+			case SDLK_LEFT:
+				collab.move(player, -1, 0);
+				break;
+			case SDLK_DOWN:
+				collab.down(player);
+				break;
+			case SDLK_UP:
+				if (!this->rotation_pressed) {
+					collab.rotate(player);
+					this->rotation_pressed = true;
+				}
+				break;
+			case SDLK_SPACE:
+				if (!this->space_pressed) {
+					collab.drop(player);
+					this->space_pressed = true;
+				}
+				break;
+			// Look around the board
+			case SDLK_i:
+				this->pan(0, -0.25);
+				break;
+			case SDLK_k:
+				this->pan(0, 0.25);
+				break;
+			case SDLK_j:
+				this->pan(-0.25, 0);
+				break;
+			case SDLK_l:
+				this->pan(0.25, 0);
+				break;
+			case SDLK_EQUALS:
+				this->zoom(2);
+				break;
+			case SDLK_MINUS:
+				this->zoom(0.5);
+				break;
+			case SDLK_c:
+				this->view.follow = true;
+				break;
+			case SDLK_r:
+				*this->collab =
+				    CollabGame(collab.board.width, collab.board.height,
+					       collab.pieces.size() - 1, std::random_device{}());
+				break;
+			case SDLK_m:
+				this->set_mute(!this->mute);
+				break;
+			case SDLK_t:
+				trace::dump(this->trace_path);
+				break;
+			default:
+				break;
+			}
+			break;
+		case SDL_KEYUP:
+			switch (this->event.key.keysym.sym) {
+			case SDLK_UP:
+				this->rotation_pressed = false;
+				break;
+			case SDLK_SPACE:
+				this->space_pressed = false;
+				break;
+			}
+			break;
+		case SDL_MOUSEWHEEL:
+			this->zoom(this->event.wheel.y > 0 ? 1.25 : 0.8);
+			break;
+		case SDL_WINDOWEVENT:
+			switch (this->event.window.event) {
+			case SDL_WINDOWEVENT_FOCUS_LOST:
+				this->pause();
+				break;
+			case SDL_WINDOWEVENT_FOCUS_GAINED:
+				this->resume();
+				break;
+			case SDL_WINDOWEVENT_RESIZED:
+				SDL_GetWindowSize(this->window, &this->width, &this->height);
+				break;
+			}
+			break;
+		default:
+			break;
+		}
+
+		if (!collab.gameover) {
+			TRACE_SCOPE("tick");
+			collab.tick(SDL_GetTicks());
+		}
+
+		if (this->view.follow) {
+			auto &block = collab.player().block;
+			this->view.x = block.offset_x + 2 - this->width / 2 / this->view.scale;
+			this->view.y = block.offset_y + 2 - this->height / 3 / this->view.scale;
+		}
+
+		this->draw_collab();
+	}
+
+	// Moves the viewport by a fraction of the window
+	void pan(double x, double y)
+	{
+		this->view.follow = false;
+		this->view.x += x * this->width / this->view.scale;
+		this->view.y += y * this->height / this->view.scale;
+	}
+
+	// Zooms the viewport in or out, keeping the middle of the window in place
+	void zoom(double factor)
+	{
+		auto &view = this->view;
+		auto middle_x = view.x + this->width / 2 / view.scale;
+		auto middle_y = view.y + this->height / 2 / view.scale;
+		view.scale = std::clamp(view.scale * factor, 0.05, 64.0);
+		view.x = middle_x - this->width / 2 / view.scale;
+		view.y = middle_y - this->height / 2 / view.scale;
+	}
+
+	// draw() for collab mode, which goes to the renderer as one batch the same way.
+	// Only rows and chunks inside the viewport are visited, so the cost depends on how much
+	// of the board is on screen rather than on its size. Zoomed out past two pixels a block,
+	// each chunk is drawn as a single shaded strip instead of block by block.
+	void draw_collab()
+	{
+		TRACE_SCOPE("draw");
+		auto &collab = *this->collab;
+		auto &board = collab.board;
+		auto &view = this->view;
+		auto &batch = this->batch;
+
+		SDL_SetRenderDrawColor(this->renderer, 84, 84, 84, 255);
+		SDL_RenderClear(this->renderer);
+
+		int x0 = std::max(0, int(std::floor(view.x)));
+		int y0 = std::max(0, int(std::floor(view.y)));
+		int x1 = std::min(board.width, int(std::ceil(view.x + this->width / view.scale)));
+		int y1 = std::min(board.height, int(std::ceil(view.y + this->height / view.scale)));
+
+		auto cells = [&](int x, int y, int w) {
+			return SDL_Rect{
+			    .x = int(std::floor((x - view.x) * view.scale)),
+			    .y = int(std::floor((y - view.y) * view.scale)),
+			    .w = std::max(1, int(std::ceil(w * view.scale))),
+			    .h = std::max(1, int(std::ceil(view.scale))),
+			};
+		};
+
+		if (x0 < x1 && y0 < y1) {
+			SDL_Rect background = cells(x0, y0, x1 - x0);
+			background.h = int(std::ceil((y1 - y0) * view.scale));
+			batch.rect(background, SDL_Color{0, 0, 0, 255});
+
+			for (int y = y0; y < y1; ++y) {
+				auto *row = board.row(y).get();
+				if (!row) {
+					continue;
+				}
+				for (int c = x0 / 64; c <= (x1 - 1) / 64; ++c) {
+					auto *chunk = row->chunks[c].get();
+					if (!chunk) {
+						continue;
+					}
+					if (view.scale < 2) {
+						auto rect = cells(c * 64, y, 64);
+						int alpha = 55 + __builtin_popcountll(chunk->mask) * 200 / 64;
+						SDL_Color shade = {255, 255, 255, Uint8(alpha)};
+						batch.rect(rect, shade);
+						continue;
+					}
+
+					// Leave out the blocks on either side of the window
+					int lo = std::max(x0 - c * 64, 0);
+					int hi = std::min(x1 - c * 64, 64);
+					uint64_t visible = hi == 64 ? ~uint64_t(0)
+								    : (uint64_t(1) << hi) - 1;
+					visible &= ~uint64_t(0) << lo;
+
+					for (auto mask = chunk->mask & visible; mask; mask &= mask - 1) {
+						int bit = __builtin_ctzll(mask);
+						auto rect = cells(c * 64 + bit, y, 1);
+						auto rgb = chunk->colors[bit];
+						SDL_Color color = {Uint8(rgb.r), Uint8(rgb.g),
+								   Uint8(rgb.b), 255};
+						batch.rect(rect, color);
+					}
+				}
+			}
+		}
+
+		for (auto &piece : collab.pieces) {
+			auto &block = piece.block;
+			if (piece.waiting || block.offset_x + 4 < x0 || block.offset_x >= x1 ||
+			    block.offset_y + 4 < y0 || block.offset_y >= y1) {
+				continue;
+			}
+			for (const auto &loc : block.coordinates()) {
+				auto &rgb = block.color;
+				batch.rect(cells(loc.x, loc.y, 1),
+					   SDL_Color{Uint8(rgb.r), Uint8(rgb.g), Uint8(rgb.b),
+						     Uint8(piece.player ? 255 : 150)});
+			}
+		}
+
+		auto *status = this->arena.format(
+		    "SCORE %d   LINES %d%s", collab.score, collab.lines,
+		    collab.gameover ? "   GAME OVER" : this->paused ? "   PAUSED" : "");
+		auto size = batch.measure(status);
+		SDL_Rect box = {
+		    .x = this->block_size / 4,
+		    .y = this->block_size / 4,
+		    .w = size.x * 2,
+		    .h = size.y * 2,
+		};
+		batch.text(status, box, SDL_Color{255, 255, 255, 255});
+		batch.flush(this->renderer);
+
+		this->present();
+	}
+
+	~GameContext()
+	{
+		this->sim.stop();
+		this->assets.stop();
+		delete this->atlas;
+		Mix_FreeMusic(this->music);
+		for (auto &button : this->buttons) {
+			SDL_FreeSurface(button.image);
+		}
+		if (this->font) {
+			TTF_CloseFont(this->font);
+		}
+		SDL_DestroyRenderer(renderer);
+		SDL_DestroyWindow(window);
+		SDL_Quit();
+	}
+};
+
+// Plays games with a bot and no window, as fast as the bot allows.
+// Every piece the bot doesn't lock itself is dropped, so each answer places exactly one piece.
+int run_headless(BotPlugin &plugin, unsigned int timeout, int games, uint64_t seed, int max_pieces,
+		 Recorder *recorder, GameEvents *events, ScoreStore *scores)
+{
+	BotDriver driver(&plugin, timeout);
+	long total = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < games; ++i) {
+		GameState game(seed + i);
+		game.recording.recorder = recorder;
+		game.outlet.events = events;
+		driver.asked = 0;
+		while (!game.gameover && (max_pieces == 0 || game.pieces <= max_pieces)) {
+			TRACE_SCOPE("turn");
+			auto pieces = game.pieces;
+			driver.think(game);
+			driver.wait(game);
+			if (game.pieces == pieces) {
+				game.drop();
+			}
+		}
+		total += game.score;
+		if (scores) {
+			scores->add(score_record(game, recorder));
+		}
+		std::cout << "game " << i << ": seed " << game.seed << ", score " << game.score
+			  << ", level " << game.level << ", pieces " << game.pieces << std::endl;
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << games << " games, average score " << (games ? total / games : 0) << ", "
+		  << driver.forfeits << " forfeited turns, " << elapsed.count() << "s" << std::endl;
+	return 0;
+}
+
+// Prints the best `count` games on the leaderboard at `path` (--top)
+int print_scores(const std::string &path, int count)
+{
+	ScoreStore scores;
+	if (!scores.open(path)) {
+		std::cerr << "Failed to open the scores file " << path << std::endl;
+		return 1;
+	}
+	vector<ScoreRecord> best(std::min<size_t>(count, ScoreStore::kept));
+	best.resize(scores.top(best.data(), best.size()));
+	for (size_t i = 0; i < best.size(); ++i) {
+		auto &record = best[i];
+		char date[32];
+		std::time_t time = record.time;
+		std::strftime(date, sizeof(date), "%Y-%m-%d %H:%M", std::localtime(&time));
+		std::printf("%4zu. %9d  level %3d  %6d pieces  %s  seed %llu%s%s%s\n", i + 1,
+			    record.score, record.level, record.pieces, date,
+			    (unsigned long long)record.seed, record.finished ? "" : " (unfinished)",
+			    record.replay[0] ? "  " : "", record.replay);
+	}
+	return 0;
+}
+
+// Plays games with the hint search's placements and no window, and says how fast the game
+// logic ran (--benchmark). Nothing but GameState is involved, so it runs the same natively
+// and under Node (make wasm-bench), which is what it is for: comparing builds.
+// Games end at topout or after `max_pieces` tetrominos.
+//
+// The same placements are then played again without the search, once as they are and once
+// sending every GameEvent to readers on other threads, to show what the events cost.
+int run_benchmark(int games, uint64_t seed, int max_pieces)
+{
+	const std::atomic<uint64_t> cancel{0};
+	long pieces = 0;
+	long lines = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	// Every game's placements, as (rotations, x), with no placement as (-1, 0)
+	vector<vector<std::pair<int, int>>> placements(games);
+	for (int i = 0; i < games; ++i) {
+		GameState game(seed + i);
+		while (!game.gameover && game.pieces <= max_pieces) {
+			auto placement = best_placement(game, 1, cancel, 0);
+			if (placement.found) {
+				steer(game, placement.rotations, placement.x);
+				placements[i].push_back({placement.rotations, placement.x});
+			} else {
+				placements[i].push_back({-1, 0});
+			}
+			game.drop();
+		}
+		pieces += game.pieces;
+		lines += (game.level - 1) * 5 + 5 - game.level_left;
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << games << " games, " << pieces << " pieces, " << lines << " lines in "
+		  << elapsed.count() << "s: " << long(pieces / elapsed.count()) << " pieces/s"
+		  << std::endl;
+
+	// One pass over every game, replaying its placements, in seconds
+	auto replay = [&](GameEvents *events) {
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < games; ++i) {
+			GameState game(seed + i);
+			game.outlet.events = events;
+			for (auto [rotations, x] : placements[i]) {
+				if (rotations >= 0) {
+					steer(game, rotations, x);
+				}
+				game.drop();
+			}
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		return elapsed.count();
+	};
+
+	// The readers run through both kinds of pass, so that the only difference between them
+	// is whether the games send events
+	auto events = std::make_unique<GameEvents>();
+	int readers = 0;
+	std::atomic<bool> done{false};
+	std::atomic<int> subscribed{0};
+	std::atomic<uint64_t> read{0};
+	std::atomic<uint64_t> missed{0};
+	vector<std::thread> threads;
+#ifndef TETRIS_NO_THREADS
+	readers = std::clamp(int(std::thread::hardware_concurrency()) - 1, 1, 3);
+	for (int i = 0; i < readers; ++i) {
+		threads.emplace_back([&]() {
+			auto reader = events->subscribe();
+			subscribed += 1;
+			uint64_t count = 0;
+			GameEvent event;
+			while (!done) {
+				while (reader.next(event)) {
+					count += 1;
+				}
+				std::this_thread::yield();
+			}
+			read += count;
+			missed += reader.missed;
+		});
+	}
+	while (subscribed < readers) {
+		std::this_thread::yield();
+	}
+#endif
+
+	// After a warm-up, the passes alternate which goes first, so neither always gets the
+	// warmer caches or the quieter moment
+	replay(nullptr);
+	replay(events.get());
+	const int rounds = 9;
+	vector<double> alone;
+	vector<double> streamed;
+	vector<double> overhead;
+	for (int round = 0; round < rounds; ++round) {
+		double without;
+		double with;
+		if (round % 2 == 0) {
+			without = replay(nullptr);
+			with = replay(events.get());
+		} else {
+			with = replay(events.get());
+			without = replay(nullptr);
+		}
+		alone.push_back(without);
+		streamed.push_back(with);
+		overhead.push_back((with - without) / pieces * 1e9);
+	}
+	done = true;
+	for (auto &thread : threads) {
+		thread.join();
+	}
+
+	auto median = [](vector<double> values) {
+		std::sort(values.begin(), values.end());
+		return values[values.size() / 2];
+	};
+	std::sort(overhead.begin(), overhead.end());
+	uint64_t sent = events->pushed() * std::max(readers, 1);
+	std::cout << "game logic alone: " << long(pieces / median(alone)) << " pieces/s; with "
+		  << events->pushed() << " events sent to " << readers
+		  << " readers: " << long(pieces / median(streamed)) << " pieces/s (median of "
+		  << rounds << " rounds)" << std::endl;
+	std::cout << "events cost " << median(overhead) << " ns more per piece (from "
+		  << overhead.front() << " to " << overhead.back() << "); the readers missed "
+		  << missed << " of " << sent << " events ("
+		  << (sent ? 100.0 * missed / sent : 0.0) << "%)" << std::endl;
+	return 0;
+}
+
+// Fills perfect_clears by playing games with the hint search's placements and searching for
+// a perfect clear before every tetromino with plenty of time to do it, then saves the table
+// to `path` for --pc-table (--pc-build). Clears that are found are followed, so the games
+// spend more of their time on the low boards where clears happen.
+int build_perfect_clears(const std::string &path, int games, uint64_t seed, int max_pieces)
+{
+	const std::atomic<uint64_t> cancel{0};
+	long pieces = 0;
+	long searched = 0;
+	long found = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < games; ++i) {
+		GameState game(seed + i);
+		while (!game.gameover && game.pieces <= max_pieces) {
+			searched += 1;
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+			auto clear = find_perfect_clear(game, deadline, cancel, 0);
+			if (clear.found) {
+				found += 1;
+				steer(game, clear.rotations[0], clear.x[0]);
+			} else {
+				auto placement = best_placement(game, 1, cancel, 0);
+				if (placement.found) {
+					steer(game, placement.rotations, placement.x);
+				}
+			}
+			game.drop();
+		}
+		pieces += game.pieces;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << games << " games, " << pieces << " pieces, a perfect clear in reach "
+		  << found << " times out of " << searched << ", " << elapsed.count() << "s"
+		  << std::endl;
+
+	if (!perfect_clears.save(path)) {
+		std::cerr << "Failed to save the perfect clear table to " << path << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+// The replay files and directories given to --analyze, handed out one file at a time.
+// Directories are read as files are asked for, so a corpus of any size is never listed in
+// memory all at once.
+class ReplaySource
+{
+      public:
+	ReplaySource(const vector<std::string> &paths) : paths(paths) {}
+
+	~ReplaySource()
+	{
+		if (this->dir) {
+			closedir(this->dir);
+		}
+	}
+
+	// The next replay to analyze, or false when there are none left
+	bool next(std::string &path)
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		for (;;) {
+			if (this->dir) {
+				while (auto *entry = readdir(this->dir)) {
+					std::string name = entry->d_name;
+					if (name.size() > 7 && name.compare(name.size() - 7, 7, ".replay") == 0) {
+						path = this->dir_path + "/" + name;
+						return true;
+					}
+				}
+				closedir(this->dir);
+				this->dir = nullptr;
+			}
+			if (this->index == this->paths.size()) {
+				return false;
+			}
+			auto &next = this->paths[this->index++];
+			struct stat info;
+			if (stat(next.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+				this->dir = opendir(next.c_str());
+				this->dir_path = next;
+			} else {
+				path = next;
+				return true;
+			}
+		}
+	}
+
+      private:
+	std::mutex mutex;
+	const vector<std::string> &paths;
+	size_t index = 0;
+	DIR *dir = nullptr;
+	std::string dir_path;
+};
+
+// What --analyze adds up, both per game and over the whole corpus
+struct ReplayStats {
+	// Stats are kept per level up to here; higher levels are counted with the last one
+	static constexpr int max_level = 100;
+
+	long games = 0;
+	long events = 0;
+	long shapes[7] = {};
+	// Indexed by the number of rows cleared at once
+	long clears[5] = {};
+	long perfect_clears = 0;
+	long topouts = 0;
+	double topout_height = 0;
+	long level_games[max_level + 1] = {};
+	long level_score[max_level + 1] = {};
+	uint64_t level_time[max_level + 1] = {};
+
+	void add(const ReplayStats &other)
+	{
+		this->games += other.games;
+		this->events += other.events;
+		for (int i = 0; i < 7; ++i) {
+			this->shapes[i] += other.shapes[i];
+		}
+		for (int i = 0; i < 5; ++i) {
+			this->clears[i] += other.clears[i];
+		}
+		this->perfect_clears += other.perfect_clears;
+		this->topouts += other.topouts;
+		this->topout_height += other.topout_height;
+		for (int i = 0; i <= max_level; ++i) {
+			this->level_games[i] += other.level_games[i];
+			this->level_score[i] += other.level_score[i];
+			this->level_time[i] += other.level_time[i];
+		}
+	}
+};
+
+// The tickspeed a game has at `level`, worked out the way GameState does it
+unsigned int tickspeed_at(int level)
+{
+	unsigned int tickspeed = 1000;
+	for (int i = 1; i < level; ++i) {
+		tickspeed *= 0.75;
+	}
+	return tickspeed;
+}
+
+// Plays one replay back and adds up what happened in it. The rows of the CSV files go
+// into `games` and `levels`. False if the file isn't a replay.
+bool analyze_replay(const std::string &path, ReplayStats &stats, std::string &games,
+		    std::string &levels)
+{
+	MappedFile file;
+	if (!file.open(path.c_str()) || file.size < sizeof(ReplayHeader) ||
+	    (file.size - sizeof(ReplayHeader)) % sizeof(ReplayEvent) != 0) {
+		return false;
+	}
+	ReplayHeader header;
+	std::memcpy(&header, file.data, sizeof(header));
+	if (std::memcmp(header.magic, replay_magic, sizeof(header.magic)) != 0 ||
+	    header.width != 10 || header.height != 20) {
+		return false;
+	}
+	auto *events = reinterpret_cast<const ReplayEvent *>(file.data + sizeof(header));
+	size_t count = (file.size - sizeof(header)) / sizeof(ReplayEvent);
+
+	// The whole game, as one row of stats
+	ReplayStats game_stats;
+	int lines = 0;
+	uint32_t last_time = 0;
+
+	GameState game(header.seed);
+	game_stats.shapes[shape_of(game.block)] += 1;
+	for (size_t i = 0; i < count && !game.gameover; ++i) {
+		auto level = std::min(game.level, ReplayStats::max_level);
+		auto score = game.score;
+		auto pieces = game.pieces;
+		int cells = game.filled.size() + game.block.locations.size();
+
+		game.replay(events[i].input);
+
+		game_stats.level_score[level] += game.score - score;
+		game_stats.level_time[level] += events[i].time - last_time;
+		last_time = events[i].time;
+		if (game.pieces != pieces) {
+			int cleared = (cells - int(game.filled.size())) / game.width;
+			if (cleared > 0) {
+				game_stats.clears[std::min(cleared, 4)] += 1;
+				lines += cleared;
+				game_stats.perfect_clears += game.filled.empty();
+			}
+			if (!game.gameover) {
+				game_stats.shapes[shape_of(game.block)] += 1;
+			}
+		}
+	}
+
+	game_stats.games = 1;
+	game_stats.events = count;
+	double height = 0;
+	for (auto top : game.skyline) {
+		height += game.height - top;
+	}
+	height /= game.width;
+	if (game.gameover) {
+		game_stats.topouts = 1;
+		game_stats.topout_height = height;
+	}
+	for (int level = 1; level <= std::min(game.level, ReplayStats::max_level); ++level) {
+		game_stats.level_games[level] = 1;
+	}
+	stats.add(game_stats);
+
+	char row[512];
+	std::snprintf(row, sizeof(row),
+		      "%s,%llu,%zu,%d,%d,%d,%d,%ld,%ld,%ld,%ld,%ld,%d,%.2f,%u,%ld,%ld,%ld,%ld,%ld,%ld,"
+		      "%ld\n",
+		      path.c_str(), (unsigned long long)header.seed, count, game.pieces, game.score,
+		      game.level, lines, game_stats.clears[1], game_stats.clears[2],
+		      game_stats.clears[3], game_stats.clears[4], game_stats.perfect_clears,
+		      int(game.gameover), height, last_time, game_stats.shapes[0],
+		      game_stats.shapes[1], game_stats.shapes[2], game_stats.shapes[3],
+		      game_stats.shapes[4], game_stats.shapes[5], game_stats.shapes[6]);
+	games += row;
+
+	for (int level = 1; level <= std::min(game.level, ReplayStats::max_level); ++level) {
+		std::snprintf(row, sizeof(row), "%s,%llu,%d,%u,%ld,%llu\n", path.c_str(),
+			      (unsigned long long)header.seed, level, tickspeed_at(level),
+			      game_stats.level_score[level],
+			      (unsigned long long)game_stats.level_time[level]);
+		levels += row;
+	}
+	return true;
+}
+
+// Plays back every replay under `paths` on `threads` threads, writing a row per game to
+// `out`/games.csv and a row per level of each game to `out`/levels.csv, then prints totals.
+// Each thread only ever holds one replay and a little output, whatever the corpus size.
+int analyze_replays(const vector<std::string> &paths, int threads, const std::string &out)
+{
+	mkdir(out.c_str(), 0755);
+	FILE *games = std::fopen((out + "/games.csv").c_str(), "w");
+	FILE *levels = std::fopen((out + "/levels.csv").c_str(), "w");
+	if (!games || !levels) {
+		std::cerr << "Failed to create the CSV files in " << out << std::endl;
+		return 1;
+	}
+	std::fputs("file,seed,events,pieces,score,level,lines,singles,doubles,triples,tetrises,"
+		   "perfect_clears,topout,topout_height,duration_ms,J,L,O,I,T,Z,S\n",
+		   games);
+	std::fputs("file,seed,level,tickspeed,score,time_ms\n", levels);
+
+	ReplaySource source(paths);
+	std::mutex output;
+	ReplayStats total;
+	long failed = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	auto work = [&]() {
+		TRACE_THREAD("analyze");
+		ReplayStats stats;
+		long bad = 0;
+		std::string game_rows;
+		std::string level_rows;
+		std::string path;
+		auto write = [&]() {
+			std::lock_guard<std::mutex> lock(output);
+			std::fwrite(game_rows.data(), 1, game_rows.size(), games);
+			std::fwrite(level_rows.data(), 1, level_rows.size(), levels);
+			game_rows.clear();
+			level_rows.clear();
+		};
+		while (source.next(path)) {
+			if (!analyze_replay(path, stats, game_rows, level_rows)) {
+				bad += 1;
+			}
+			if (game_rows.size() + level_rows.size() > 64 * 1024) {
+				write();
+			}
+		}
+		write();
+		std::lock_guard<std::mutex> lock(output);
+		total.add(stats);
+		failed += bad;
+	};
+
+	vector<std::thread> workers;
+	for (int i = 0; i < threads; ++i) {
+		workers.emplace_back(work);
+	}
+	for (auto &worker : workers) {
+		worker.join();
+	}
+	std::fclose(games);
+	std::fclose(levels);
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	printf("%ld games, %ld inputs in %.2fs on %d threads: %.0f games/s", total.games,
+	       total.events, elapsed.count(), threads, total.games / elapsed.count());
+	if (failed) {
+		printf(", %ld files skipped", failed);
+	}
+	printf("\n");
+	if (!total.games) {
+		return 0;
+	}
+
+	const char *names = "JLOITZS";
+	long shapes = 0;
+	for (auto count : total.shapes) {
+		shapes += count;
+	}
+	printf("pieces:");
+	for (int i = 0; i < 7; ++i) {
+		printf(" %c %.1f%%", names[i], 100.0 * total.shapes[i] / std::max(shapes, 1L));
+	}
+	printf("\nclears: %ld singles, %ld doubles, %ld triples, %ld tetrises, %ld perfect\n",
+	       total.clears[1], total.clears[2], total.clears[3], total.clears[4],
+	       total.perfect_clears);
+	printf("topouts: %ld, average stack height %.2f\n", total.topouts,
+	       total.topouts ? total.topout_height / total.topouts : 0.0);
+	printf("level  tickspeed  games  score/game  seconds/game\n");
+	for (int level = 1; level <= ReplayStats::max_level && total.level_games[level]; ++level) {
+		auto count = total.level_games[level];
+		printf("%5d  %9u  %5ld  %10.0f  %12.1f\n", level, tickspeed_at(level), count,
+		       double(total.level_score[level]) / count,
+		       total.level_time[level] / 1000.0 / count);
+	}
+	return 0;
+}
+
+// Where the falling tetromino lands and whether the game is over, worked out the way the game
+// did before it kept `rows` and `skyline`: by looking through `filled` with Block::can_descend
+class FilledScan
+{
+      public:
+	static int drop_distance(GameState &game)
+	{
+		Block block = game.block;
+		int d = 0;
+		while (block.can_descend(&game.filled, game.height)) {
+			block.offset_y += 1;
+			d += 1;
+		}
+		return d;
+	}
+
+	static bool is_gameover(const GameState &game)
+	{
+		for (const auto &loc : game.filled) {
+			if (loc.y == 0 && loc.x >= 0 && loc.x < game.width) {
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+// Checks the game logic with no window (--check, or make check), printing whatever is wrong
+// and returning nonzero if anything was.
+//
+// Each of `games` seeds is played twice, once with random inputs and once with the hint
+// search's placements. After every input, the drop distance, where bottom() puts the
+// tetromino and game over have to agree with FilledScan. Both games are recorded, and
+// their replays have to end with the same score (as analyze_replay sees it) and the same
+// board as the games did.
+int run_checks(int games, uint64_t seed)
+{
+	const std::atomic<uint64_t> cancel{0};
+	long checked = 0;
+	long failures = 0;
+	long replays = 0;
+
+	char dir[] = "/tmp/tetris-check-XXXXXX";
+	if (!mkdtemp(dir)) {
+		std::cerr << "Failed to make a directory for the replays" << std::endl;
+		return 1;
+	}
+
+	auto check = [&](GameState &game, const char *how) {
+		checked += 1;
+		int expected = FilledScan::drop_distance(game);
+		int dropped = -1;
+		Block landed = game.bottom(&dropped);
+		bool gameover = FilledScan::is_gameover(game);
+		if (game.drop_distance(game.block) != expected || dropped != expected ||
+		    landed.offset_y != game.block.offset_y + expected ||
+		    game.is_gameover() != gameover) {
+			if (failures < 10) {
+				std::cerr << how << " game " << game.seed << ", piece "
+					  << game.pieces << ": drop distance " << dropped
+					  << " instead of " << expected << ", game over "
+					  << game.is_gameover() << " instead of " << gameover
+					  << std::endl;
+			}
+			failures += 1;
+		}
+	};
+	auto check_replay = [&](const GameState &game, const std::string &path, const char *how) {
+		replays += 1;
+		ReplayStats stats;
+		std::string row;
+		std::string levels;
+		unsigned long long seed = 0;
+		size_t events = 0;
+		long pieces = -1;
+		long score = -1;
+		if (analyze_replay(path, stats, row, levels)) {
+			// games.csv starts with the path, seed, events, pieces and score
+			std::sscanf(row.c_str() + path.size(), ",%llu,%zu,%ld,%ld", &seed, &events,
+				    &pieces, &score);
+		}
+
+		GameState replayed(game.seed);
+		MappedFile file;
+		if (file.open(path.c_str()) && file.size >= sizeof(ReplayHeader)) {
+			auto *events =
+			    reinterpret_cast<const ReplayEvent *>(file.data + sizeof(ReplayHeader));
+			size_t count = (file.size - sizeof(ReplayHeader)) / sizeof(ReplayEvent);
+			for (size_t i = 0; i < count && !replayed.gameover; ++i) {
+				replayed.replay(events[i].input);
+			}
+		}
+
+		if (pieces != game.pieces || score != game.score || replayed.score != game.score ||
+		    replayed.rows != game.rows || replayed.block.offset_x != game.block.offset_x ||
+		    replayed.block.offset_y != game.block.offset_y) {
+			if (failures < 10) {
+				std::cerr << how << " game " << game.seed << ": scored "
+					  << game.score << " with " << game.pieces
+					  << " pieces, but its replay scored " << score << " with "
+					  << pieces << " pieces"
+					  << (replayed.rows != game.rows ? " on another board" : "")
+					  << std::endl;
+			}
+			failures += 1;
+		}
+	};
+
+	// Every tetromino in play has to fit where it is, and the rows' counts have to match
+	// their cells, with no complete row left behind
+	auto check_collab = [&](CollabGame &collab) {
+		checked += 1;
+		auto &board = collab.board;
+		int overlapping = 0;
+		for (auto &piece : collab.pieces) {
+			// Except for the player's at the end, which had no room to come in
+			bool over = piece.player && collab.gameover;
+			overlapping += !piece.waiting && !over && !collab.fits(piece.block, 0, 0);
+		}
+		int miscounted = 0;
+		for (int y = 0; y < board.height; ++y) {
+			auto *row = board.row(y).get();
+			int count = 0;
+			for (int c = 0; row && c < board.chunk_count(); ++c) {
+				auto &chunk = row->chunks[c];
+				count += chunk ? __builtin_popcountll(chunk->mask) : 0;
+			}
+			miscounted += row && (count != row->count || count == board.width);
+		}
+		if (overlapping || miscounted) {
+			if (failures < 10) {
+				std::cerr << "collab game " << collab.rng << ": " << overlapping
+					  << " tetrominos where they don't fit, " << miscounted
+					  << " rows miscounted" << std::endl;
+			}
+			failures += 1;
+		}
+	};
+
+	for (int i = 0; i < games; ++i) {
+		std::mt19937_64 random(seed + i);
+		GameState game(seed + i);
+		auto recorder = std::make_unique<Recorder>(dir, 0);
+		game.recording.recorder = recorder.get();
+		for (int inputs = 0; !game.gameover && inputs < 5000; ++inputs) {
+			switch (random() % 8) {
+			case 0:
+			case 1:
+				game.left();
+				break;
+			case 2:
+			case 3:
+				game.right();
+				break;
+			case 4:
+				game.rotate();
+				break;
+			case 5:
+				game.down();
+				break;
+			case 6:
+				game.fall();
+				break;
+			case 7:
+				game.drop();
+				break;
+			}
+			check(game, "random");
+		}
+		std::string path = recorder->path();
+		recorder = std::make_unique<Recorder>(dir, 1);
+		check_replay(game, path, "random");
+		std::remove(path.c_str());
+
+		game = GameState(seed + i);
+		game.recording.recorder = recorder.get();
+		while (!game.gameover && game.pieces <= 1000) {
+			auto placement = best_placement(game, 1, cancel, 0);
+			if (placement.found) {
+				steer(game, placement.rotations, placement.x);
+			}
+			check(game, "placed");
+			game.drop();
+			check(game, "placed");
+		}
+		path = recorder->path();
+		recorder.reset();
+		check_replay(game, path, "placed");
+		std::remove(path.c_str());
+
+		// Collab mode, on a board small enough for the crowd to fill up
+		CollabGame collab(24, 16, 12, seed + i);
+		auto now = collab.player().last_tick;
+		for (int steps = 0; !collab.gameover && steps < 5000; ++steps) {
+			now += 50;
+			if (random() % 4 == 0) {
+				collab.move(collab.player(), random() % 2 ? 1 : -1, 0);
+			}
+			collab.tick(now);
+			check_collab(collab);
+		}
+	}
+	rmdir(dir);
+
+	std::cout << games * 3 << " games, " << checked << " positions and " << replays
+		  << " replays checked, " << failures << " wrong" << std::endl;
+	return failures ? 1 : 0;
+}
+
+GameContext *ctx;
+void do_loop() { ctx->loop(); }
+
+// Renders a replay the way the window would have shown it, with no window (--export), at
+// `fps` frames a second: as a YUV4MPEG2 stream if `out` ends in .y4m (or is -, for
+// stdout), or as numbered PNGs in the directory `out` otherwise. A replay recorded with a
+// clock plays at the speed it was played; one without (from --headless) advances an input
+// a frame. The last frame is held for a second.
+int export_replay(const std::string &path, const std::string &out, int width, int height,
+		  int fps)
+{
+	MappedFile file;
+	ReplayHeader header = {};
+	if (file.open(path.c_str()) && file.size >= sizeof(header) &&
+	    (file.size - sizeof(header)) % sizeof(ReplayEvent) == 0) {
+		std::memcpy(&header, file.data, sizeof(header));
+	}
+	// Games are always recorded on the usual board, as analyze_replay() expects too, so
+	// any other size is a damaged file
+	if (std::memcmp(header.magic, replay_magic, sizeof(header.magic)) != 0 ||
+	    header.width != 10 || header.height != 20) {
+		std::cerr << path << ": not a replay" << std::endl;
+		return 1;
+	}
+	auto *events = reinterpret_cast<const ReplayEvent *>(file.data + sizeof(header));
+	size_t count = (file.size - sizeof(header)) / sizeof(ReplayEvent);
+
+	bool y4m = out == "-" || (out.size() > 4 && out.compare(out.size() - 4, 4, ".y4m") == 0);
+	if (y4m && (width % 2 || height % 2)) {
+		std::cerr << "--size has to be even for a .y4m" << std::endl;
+		return 1;
+	}
+
+	// The same assets the window uses, minus the music
+	AssetLoader assets;
+	vector<Button> buttons;
+	vector<std::string> images;
+	for (const char *id : {"replay", "mute", "unmute"}) {
+		buttons.push_back(Button{.id = id, .box = {0, 0, 0, 0}, .image = nullptr});
+		images.push_back(std::string(id) + ".png");
+	}
+	assets.start(images, false);
+	while (!assets.ready()) {
+		SDL_Delay(1);
+	}
+	if (!assets.error.empty()) {
+		std::cerr << assets.error << std::endl;
+		return 1;
+	}
+	for (size_t i = 0; i < buttons.size(); ++i) {
+		buttons[i].source = assets.sources[i];
+	}
+
+	Batch batch;
+	batch.atlas = assets.atlas;
+	FrameArena arena;
+	BoardView board(batch, arena);
+	board.buttons = &buttons;
+	Framebuffer frame(width, height);
+	int block_size = height * 0.05;
+	Location offset = {block_size / 4, block_size / 4};
+
+	Y4mWriter video;
+	if (y4m) {
+		if (!video.open(out, width, height, fps)) {
+			std::cerr << "Failed to create " << out << std::endl;
+			return 1;
+		}
+	} else {
+		mkdir(out.c_str(), 0755);
+	}
+
+	GameState game(header.seed);
+	game.set_size(header.height, header.width);
+	bool clocked = count > 0 && events[count - 1].time > 0;
+	size_t next = 0;
+	int held = 0;
+	int frames = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	for (; held < fps; ++frames) {
+		if (next < count && !game.gameover) {
+			uint32_t now = uint64_t(frames) * 1000 / fps;
+			while (next < count && !game.gameover &&
+			       (clocked ? events[next].time <= now : frames > 0)) {
+				game.replay(events[next++].input);
+				if (!clocked) {
+					break;
+				}
+			}
+		} else {
+			held += 1;
+		}
+
+		TRACE_SCOPE("export.frame");
+		frame.clear(SDL_Color{84, 84, 84, 255});
+		board.draw(game, block_size, offset, height);
+		frame.draw(batch);
+		arena.reset();
+
+		bool written;
+		if (y4m) {
+			written = video.write(frame);
+		} else {
+			written = frame.save_png(arena.format("%s/%06d.png", out.c_str(), frames));
+		}
+		if (!written) {
+			std::cerr << "Failed to write frame " << frames << " to " << out
+				  << std::endl;
+			break;
+		}
+	}
+	video.close();
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	double seconds = double(frames) / fps;
+	std::cerr << frames << " frames (" << seconds << "s of video) in " << elapsed.count()
+		  << "s, " << seconds / elapsed.count() << "x real time" << std::endl;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	// Static initialization, from when process_start was set
+	double entered = since_start();
+
+	vector<std::string> bot_paths;
+	unsigned int bot_timeout = 50;
+	int boards = 1;
+	int players = -1;
+	bool headless = false;
+	bool benchmark = false;
+	bool checks = false;
+	int games = 1;
+	uint64_t seed = std::random_device{}();
+	int max_pieces = 0;
+	int collab_width = 0;
+	int collab_height = 0;
+	int crowd = 0;
+	std::string trace_path = "trace.json";
+	bool alloc_stats = false;
+	std::string session_path = "tetris.session";
+	std::string scores_path;
+	bool no_scores = false;
+	int top = 0;
+	std::string record_dir;
+	std::string events_path;
+	vector<std::string> analyze_paths;
+	int threads = std::max(1u, std::thread::hardware_concurrency());
+	std::string out_dir = "analysis";
+	std::string export_path;
+	std::string video_path = "export.y4m";
+	int fps = 30;
+	int export_width = 646;
+	int export_height = 836;
+	std::string pc_table_path;
+	std::string pc_build_path;
+
+	// Count SDL's allocations along with ours. This has to happen before anything else
+	// in SDL allocates.
+	SDL_SetMemoryFunctions(counted_malloc, counted_calloc, counted_realloc, std::free);
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == "--bot" && has_value) {
+			bot_paths.push_back(argv[++i]);
+		} else if (arg == "--bot-timeout" && has_value) {
+			bot_timeout = std::stoul(argv[++i]);
+		} else if (arg == "--boards" && has_value) {
+			boards = std::max(std::stoi(argv[++i]), 1);
+		} else if (arg == "--players" && has_value) {
+			players = std::stoi(argv[++i]);
+		} else if (arg == "--headless") {
+			headless = true;
+		} else if (arg == "--benchmark") {
+			benchmark = true;
+		} else if (arg == "--check") {
+			checks = true;
+		} else if (arg == "--pc-table" && has_value) {
+			pc_table_path = argv[++i];
+		} else if (arg == "--pc-build" && has_value) {
+			pc_build_path = argv[++i];
+		} else if (arg == "--games" && has_value) {
+			games = std::stoi(argv[++i]);
+		} else if (arg == "--seed" && has_value) {
+			seed = std::stoull(argv[++i]);
+		} else if (arg == "--pieces" && has_value) {
+			max_pieces = std::stoi(argv[++i]);
+		} else if (arg == "--collab" && has_value &&
+			   std::sscanf(argv[++i], "%dx%d", &collab_width, &collab_height) == 2 &&
+			   collab_width > 0 && collab_height > 0) {
+		} else if (arg == "--crowd" && has_value) {
+			crowd = std::stoi(argv[++i]);
+		} else if (arg == "--trace" && has_value) {
+			trace_path = argv[++i];
+		} else if (arg == "--alloc-stats") {
+			alloc_stats = true;
+		} else if (arg == "--startup-profile") {
+			startup.enabled = true;
+		} else if (arg == "--session" && has_value) {
+			session_path = argv[++i];
+		} else if (arg == "--no-session") {
+			session_path = "";
+		} else if (arg == "--scores" && has_value) {
+			scores_path = argv[++i];
+		} else if (arg == "--no-scores") {
+			no_scores = true;
+		} else if (arg == "--top" && has_value) {
+			top = std::max(std::stoi(argv[++i]), 1);
+		} else if (arg == "--record" && has_value) {
+			record_dir = argv[++i];
+		} else if (arg == "--events" && has_value) {
+			events_path = argv[++i];
+		} else if (arg == "--analyze" && has_value) {
+			analyze_paths.push_back(argv[++i]);
+		} else if (arg == "--threads" && has_value) {
+			threads = std::max(std::stoi(argv[++i]), 1);
+		} else if (arg == "--out" && has_value) {
+			out_dir = argv[++i];
+		} else if (arg == "--export" && has_value) {
+			export_path = argv[++i];
+		} else if (arg == "--video" && has_value) {
+			video_path = argv[++i];
+		} else if (arg == "--fps" && has_value) {
+			fps = std::max(std::stoi(argv[++i]), 1);
+		} else if (arg == "--size" && has_value &&
+			   std::sscanf(argv[++i], "%dx%d", &export_width, &export_height) == 2 &&
+			   export_width > 0 && export_height > 0) {
+		} else {
+			std::cerr << "usage: " << argv[0]
+				  << " [--bot path.so]... [--bot-timeout ms] [--boards n] [--players n]"
+				     " [--headless [--games n] [--seed n] [--pieces n]]"
+				     " [--benchmark [--games n] [--seed n] [--pieces n]]"
+				     " [--check [--games n] [--seed n]]"
+				     " [--pc-build path [--games n] [--seed n] [--pieces n]]"
+				     " [--pc-table path]"
+				     " [--collab WIDTHxHEIGHT [--crowd n]] [--trace path.json]"
+				     " [--alloc-stats] [--startup-profile] [--session path | --no-session]"
+				     " [--scores path | --no-scores] [--top n]"
+				     " [--record dir] [--events path.csv]"
+				     " [--analyze path [--threads n] [--out dir]]..."
+				     " [--export path.replay [--video out.y4m|dir] [--fps n]"
+				     " [--size WIDTHxHEIGHT]]"
+				  << std::endl;
+			return 1;
+		}
+	}
+
+	TRACE_THREAD("main");
+	if (!trace::enabled && trace_path != "trace.json") {
+		std::cerr << "--trace needs a build with tracing (make TRACE=1)" << std::endl;
+	}
+
+	startup.record("before main", 0, entered);
+
+	if (top) {
+		return print_scores(scores_path.empty() ? "tetris.scores" : scores_path, top);
+	}
+	if (!pc_table_path.empty() && !perfect_clears.load(pc_table_path)) {
+		std::cerr << "Failed to load the perfect clear table " << pc_table_path
+			  << std::endl;
+	}
+	if (checks) {
+		return run_checks(games, seed);
+	}
+	if (benchmark) {
+		return run_benchmark(games, seed, max_pieces ? max_pieces : 1000);
+	}
+	if (!pc_build_path.empty()) {
+		return build_perfect_clears(pc_build_path, games, seed,
+					    max_pieces ? max_pieces : 1000);
+	}
+	if (!export_path.empty()) {
+		auto status =
+		    export_replay(export_path, video_path, export_width, export_height, fps);
+		trace::dump(trace_path);
+		return status;
+	}
+	if (!analyze_paths.empty()) {
+		auto status = analyze_replays(analyze_paths, threads, out_dir);
+		trace::dump(trace_path);
+		return status;
+	}
+	if (!record_dir.empty()) {
+		mkdir(record_dir.c_str(), 0755);
+	}
+
+	// Outlives the game, whose bots run the plugins' code
+	vector<std::unique_ptr<BotPlugin>> bots;
+	try {
+		{
+			StartupPhase phase("bots");
+			for (const auto &path : bot_paths) {
+				bots.push_back(std::make_unique<BotPlugin>(path));
+			}
+		}
+
+		if (headless) {
+			if (bots.empty()) {
+				std::cerr << "--headless needs a --bot to play" << std::endl;
+				return 1;
+			}
+			std::unique_ptr<Recorder> recorder;
+			if (!record_dir.empty()) {
+				recorder = std::make_unique<Recorder>(record_dir, 0);
+			}
+			std::unique_ptr<GameEvents> events;
+			std::unique_ptr<EventLog> log;
+			if (!events_path.empty()) {
+				events = std::make_unique<GameEvents>();
+				log = std::make_unique<EventLog>(*events, events_path);
+			}
+			// Bots only go on the leaderboard when asked to
+			std::unique_ptr<ScoreStore> scores;
+			if (!scores_path.empty() && !no_scores) {
+				scores = std::make_unique<ScoreStore>();
+				if (!scores->open(scores_path)) {
+					std::cerr << "Failed to open the scores file "
+						  << scores_path << std::endl;
+					return 1;
+				}
+			}
+			auto status = run_headless(*bots[0], bot_timeout, games, seed, max_pieces,
+						   recorder.get(), events.get(), scores.get());
+			trace::dump(trace_path);
+			return status;
+		}
+
+		// Without bots everyone plays from the keyboard, as far as there are keymaps
+		if (players < 0) {
+			players = bots.empty() ? boards : 0;
+		}
+		players = std::min({players, boards, int(keymaps.size())});
+		if (players < boards && bots.empty()) {
+			std::cerr << "boards past the " << keymaps.size()
+				  << " played from the keyboard need a --bot" << std::endl;
+			return 1;
+		}
+
+		ctx = new GameContext();
+		ctx->trace_path = trace_path;
+		ctx->alloc_stats = alloc_stats;
+		if (boards > 1 || players == 0) {
+			ctx->set_boards(boards, players, bots, bot_timeout, seed);
+		}
+		if (collab_width) {
+			ctx->collab = new CollabGame(collab_width, collab_height, crowd, seed);
+		} else {
+			if (!record_dir.empty()) {
+				ctx->sim.record(record_dir);
+			}
+			if (!events_path.empty()) {
+				ctx->sim.log_events(events_path);
+			}
+			if (!no_scores) {
+				ctx->sim.keep_scores(scores_path.empty() ? "tetris.scores"
+									 : scores_path);
+			}
+			// Only a single player's game is worth picking up again
+			if (boards == 1 && players == 1 && !session_path.empty()) {
+				StartupPhase phase("session");
+				ctx->sim.open_session(session_path);
+			}
+			ctx->sim.start();
+		}
+		ctx->created = since_start();
+	} catch (const std::exception &error) {
+		std::cerr << error.what() << std::endl;
+		return 1;
+	}
 
-int main()
-{
 #ifdef __EMSCRIPTEN__
 	emscripten_set_main_loop(do_loop, 0, 1);
 #else
-	while (ctx.should_continue) {
-		ctx.loop();
+	while (ctx->should_continue) {
+		ctx->loop();
 		// Keep the game from hogging all the CPU
 		SDL_Delay(10);
 	}
+	trace::dump(trace_path);
+	delete ctx;
 #endif
 
 	return 0;
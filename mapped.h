@@ -0,0 +1,106 @@
+/* Copyright 2022 Josias Allestad <me@josias.dev> and Jacob <zathaxx@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Files mapped into memory.
+#ifndef TETRIS_MAPPED_H
+#define TETRIS_MAPPED_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class MappedFile
+{
+      public:
+	char *data = nullptr;
+	size_t size = 0;
+
+	MappedFile() = default;
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	~MappedFile() { this->close(); }
+
+	// Maps all of an existing file, read-only. False if it can't be.
+	bool open(const char *path)
+	{
+		this->close();
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat info;
+		if (fstat(fd, &info) != 0 || info.st_size == 0) {
+			::close(fd);
+			return false;
+		}
+		return this->map(fd, info.st_size, PROT_READ);
+	}
+
+	// Maps `path` for reading and writing, creating it or growing it to `size` bytes first.
+	// Whatever the file already held is kept.
+	bool create(const char *path, size_t size)
+	{
+		this->close();
+		int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat info;
+		if (fstat(fd, &info) != 0 ||
+		    (size_t(info.st_size) < size && ftruncate(fd, size) != 0)) {
+			::close(fd);
+			return false;
+		}
+		return this->map(fd, size, PROT_READ | PROT_WRITE);
+	}
+
+	// Writes the given range back to the file, returning once it is on disk
+	bool sync(size_t offset, size_t length)
+	{
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t start = offset / page * page;
+		return msync(this->data + start, offset + length - start, MS_SYNC) == 0;
+	}
+
+	void close()
+	{
+		if (this->data) {
+			munmap(this->data, this->size);
+		}
+		this->data = nullptr;
+		this->size = 0;
+	}
+
+      private:
+	bool map(int fd, size_t size, int protection)
+	{
+		void *data = mmap(nullptr, size, protection, MAP_SHARED, fd, 0);
+		// The mapping keeps the file open by itself
+		::close(fd);
+		if (data == MAP_FAILED) {
+			return false;
+		}
+		this->data = static_cast<char *>(data);
+		this->size = size;
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,81 @@
+/* Copyright 2022 Josias Allestad <me@josias.dev> and Jacob <zathaxx@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Packs assets into a bundle (see bundle.h).
+//
+//	$ ./pack assets.bundle assets/*
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "bundle.h"
+
+using std::vector;
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		std::cerr << "usage: " << argv[0] << " out.bundle asset..." << std::endl;
+		return 1;
+	}
+
+	vector<BundleEntry> entries;
+	vector<vector<char>> contents;
+	uint64_t offset = sizeof(BundleHeader) + (argc - 2) * sizeof(BundleEntry);
+	for (int i = 2; i < argc; ++i) {
+		std::string path = argv[i];
+		std::string name = path.substr(path.find_last_of('/') + 1);
+		if (name.size() >= sizeof(BundleEntry::name)) {
+			std::cerr << name << ": name too long" << std::endl;
+			return 1;
+		}
+		std::ifstream in(path, std::ios::binary);
+		if (!in) {
+			std::cerr << path << ": can't read" << std::endl;
+			return 1;
+		}
+		contents.emplace_back(std::istreambuf_iterator<char>(in),
+				      std::istreambuf_iterator<char>());
+
+		BundleEntry entry = {};
+		std::memcpy(entry.name, name.data(), name.size());
+		offset = (offset + 15) / 16 * 16;
+		entry.offset = offset;
+		entry.size = contents.back().size();
+		entries.push_back(entry);
+		offset += entry.size;
+	}
+
+	std::ofstream out(argv[1], std::ios::binary);
+	BundleHeader header = {};
+	std::memcpy(header.magic, bundle_magic, sizeof(header.magic));
+	header.count = entries.size();
+	out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char *>(entries.data()),
+		  entries.size() * sizeof(BundleEntry));
+	for (size_t i = 0; i < entries.size(); ++i) {
+		// Pad up to where the entry says the asset starts
+		out.seekp(entries[i].offset);
+		out.write(contents[i].data(), contents[i].size());
+	}
+	if (!out) {
+		std::cerr << argv[1] << ": can't write" << std::endl;
+		return 1;
+	}
+	return 0;
+}
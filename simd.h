@@ -0,0 +1,146 @@
+/* Copyright 2022 Josias Allestad <me@josias.dev> and Jacob <zathaxx@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// The inner loops of the game, done on the row bitmasks of a board (see GameState::rows):
+// whether a tetromino overlaps what is already filled, and which rows are complete.
+// Built with -msimd128 (make wasm-fast), they use WebAssembly SIMD to look at two rows
+// at once; everywhere else they are plain loops.
+//
+// Also the spans of pixels that Framebuffer fills, four pixels at a time with SSE2 or
+// WebAssembly SIMD.
+#ifndef TETRIS_SIMD_H
+#define TETRIS_SIMD_H
+
+#include <cstdint>
+
+#ifdef __wasm_simd128__
+#include <wasm_simd128.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Whether any of the four rows starting at rows[top] shares a bit with the matching mask
+// of `piece`. Rows past either end of the board count as empty.
+inline bool rows_overlap(const uint64_t *rows, int height, int top, const uint64_t piece[4])
+{
+	uint64_t window[4] = {0, 0, 0, 0};
+	const uint64_t *source = rows + top;
+	if (top < 0 || top + 4 > height) {
+		for (int i = 0; i < 4; ++i) {
+			if (top + i >= 0 && top + i < height) {
+				window[i] = rows[top + i];
+			}
+		}
+		source = window;
+	}
+#ifdef __wasm_simd128__
+	v128_t low = wasm_v128_and(wasm_v128_load(source), wasm_v128_load(piece));
+	v128_t high = wasm_v128_and(wasm_v128_load(source + 2), wasm_v128_load(piece + 2));
+	return wasm_v128_any_true(wasm_v128_or(low, high));
+#else
+	return ((source[0] & piece[0]) | (source[1] & piece[1]) | (source[2] & piece[2]) |
+		(source[3] & piece[3])) != 0;
+#endif
+}
+
+// Which of the first `count` (at most 64) rows have every bit of `full` set, as a bitmask:
+// bit y is set when rows[y] is complete. Bits outside `full` don't matter.
+inline uint64_t full_rows(const uint64_t *rows, int count, uint64_t full)
+{
+	uint64_t complete = 0;
+	int y = 0;
+#ifdef __wasm_simd128__
+	v128_t want = wasm_i64x2_splat(full);
+	for (; y + 2 <= count; y += 2) {
+		v128_t equal = wasm_i64x2_eq(wasm_v128_and(wasm_v128_load(rows + y), want), want);
+		complete |= uint64_t(wasm_i64x2_bitmask(equal)) << y;
+	}
+#endif
+	for (; y < count; ++y) {
+		complete |= uint64_t((rows[y] & full) == full) << y;
+	}
+	return complete;
+}
+
+// Sets `count` pixels to `color`
+inline void fill_span(uint32_t *pixels, int count, uint32_t color)
+{
+	int i = 0;
+#ifdef __wasm_simd128__
+	v128_t four = wasm_i32x4_splat(color);
+	for (; i + 4 <= count; i += 4) {
+		wasm_v128_store(pixels + i, four);
+	}
+#elif defined(__SSE2__)
+	__m128i four = _mm_set1_epi32(color);
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(pixels + i), four);
+	}
+#endif
+	for (; i < count; ++i) {
+		pixels[i] = color;
+	}
+}
+
+// Draws `color` over `count` pixels at `alpha` (0 to 255). Every byte of a pixel becomes
+// (color * alpha + pixel * (255 - alpha)) / 255, rounded, whichever way the span is done.
+inline void blend_span(uint32_t *pixels, int count, uint32_t color, int alpha)
+{
+	int i = 0;
+#ifdef __wasm_simd128__
+	v128_t source = wasm_u16x8_extend_low_u8x16(wasm_i32x4_splat(color));
+	v128_t base = wasm_i16x8_add(wasm_i16x8_mul(source, wasm_i16x8_splat(alpha)),
+				     wasm_i16x8_splat(128));
+	v128_t keep = wasm_i16x8_splat(255 - alpha);
+	for (; i + 4 <= count; i += 4) {
+		v128_t four = wasm_v128_load(pixels + i);
+		v128_t low = wasm_i16x8_add(
+		    wasm_i16x8_mul(wasm_u16x8_extend_low_u8x16(four), keep), base);
+		v128_t high = wasm_i16x8_add(
+		    wasm_i16x8_mul(wasm_u16x8_extend_high_u8x16(four), keep), base);
+		low = wasm_u16x8_shr(wasm_i16x8_add(low, wasm_u16x8_shr(low, 8)), 8);
+		high = wasm_u16x8_shr(wasm_i16x8_add(high, wasm_u16x8_shr(high, 8)), 8);
+		wasm_v128_store(pixels + i, wasm_u8x16_narrow_i16x8(low, high));
+	}
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	__m128i source = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+	__m128i base = _mm_add_epi16(_mm_mullo_epi16(source, _mm_set1_epi16(alpha)),
+				     _mm_set1_epi16(128));
+	__m128i keep = _mm_set1_epi16(255 - alpha);
+	for (; i + 4 <= count; i += 4) {
+		auto *at = reinterpret_cast<__m128i *>(pixels + i);
+		__m128i four = _mm_loadu_si128(at);
+		__m128i low =
+		    _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(four, zero), keep), base);
+		__m128i high =
+		    _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(four, zero), keep), base);
+		low = _mm_srli_epi16(_mm_add_epi16(low, _mm_srli_epi16(low, 8)), 8);
+		high = _mm_srli_epi16(_mm_add_epi16(high, _mm_srli_epi16(high, 8)), 8);
+		_mm_storeu_si128(at, _mm_packus_epi16(low, high));
+	}
+#endif
+	for (; i < count; ++i) {
+		uint32_t blended = 0;
+		for (int shift = 0; shift < 32; shift += 8) {
+			uint32_t t = ((color >> shift) & 255) * alpha +
+				     ((pixels[i] >> shift) & 255) * (255 - alpha) + 128;
+			blended |= ((t + (t >> 8)) >> 8) << shift;
+		}
+		pixels[i] = blended;
+	}
+}
+
+#endif
@@ -0,0 +1,262 @@
+/* Copyright 2022 Josias Allestad <me@josias.dev> and Jacob <zathaxx@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Trace markers for finding out where a frame's time goes.
+//
+//	TRACE_SCOPE("draw");      // from here to the end of the block
+//	TRACE_BEGIN("events");    // from here...
+//	TRACE_END();              // ...to here
+//
+// Build with `make TRACE=1` to record them. Otherwise the markers compile to nothing.
+// Each thread records into its own ring buffer, which only it writes to, so recording
+// never takes a lock. The most recent events of every thread can be saved at any time
+// as Chrome trace-event JSON, to be opened in chrome://tracing or ui.perfetto.dev.
+#ifndef TETRIS_TRACE_H
+#define TETRIS_TRACE_H
+
+#include <string>
+
+#ifdef TETRIS_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <vector>
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#endif
+
+namespace trace
+{
+
+const bool enabled = true;
+
+struct Event {
+	// Always a string literal
+	const char *name;
+	// Nanoseconds since the first event
+	uint64_t time;
+	// 'B' for the start of a span, 'E' for the end
+	char phase;
+};
+
+// The events recorded by one thread. The newest `capacity` are kept.
+//
+// A trace can be saved while the thread is still recording, so each slot works like a
+// BroadcastRing's (see lockfree.h): it carries the number of the event in it, odd while it
+// is being written and even once it is done, and its fields are atomics so that reading
+// one that is being written over is well defined. The reader checks the number again after
+// copying the event and throws the copy away if it changed.
+class Buffer
+{
+      public:
+	static const uint64_t capacity = 1 << 14;
+
+	struct Slot {
+		std::atomic<uint64_t> sequence{0};
+		std::atomic<const char *> name{nullptr};
+		std::atomic<uint64_t> time{0};
+		std::atomic<char> phase{0};
+	};
+
+	std::unique_ptr<Slot[]> slots = std::make_unique<Slot[]>(capacity);
+	std::atomic<uint64_t> head{0};
+
+	int tid;
+	// Set by its thread (TRACE_THREAD) whenever, so it may change while a trace is saved
+	std::atomic<const char *> name{"thread"};
+
+	// Whether a running thread is recording into it
+	bool owned = true;
+
+	void push(const char *name, char phase, uint64_t time)
+	{
+		auto head = this->head.load(std::memory_order_relaxed);
+		auto &slot = this->slots[head % capacity];
+		slot.sequence.store(head * 2 + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.name.store(name, std::memory_order_relaxed);
+		slot.time.store(time, std::memory_order_relaxed);
+		slot.phase.store(phase, std::memory_order_relaxed);
+		slot.sequence.store(head * 2 + 2, std::memory_order_release);
+		this->head.store(head + 1, std::memory_order_release);
+	}
+
+	// Copies out event number `i`. False if it has been written over, or is being.
+	bool read(uint64_t i, Event &event) const
+	{
+		auto &slot = this->slots[i % capacity];
+		uint64_t done = i * 2 + 2;
+		if (slot.sequence.load(std::memory_order_acquire) != done) {
+			return false;
+		}
+		event.name = slot.name.load(std::memory_order_relaxed);
+		event.time = slot.time.load(std::memory_order_relaxed);
+		event.phase = slot.phase.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return slot.sequence.load(std::memory_order_relaxed) == done;
+	}
+};
+
+// Every thread's buffer. Buffers outlive their threads, so a trace saved later still has
+// their events; a new thread takes over the buffer of one that has finished.
+inline std::mutex registry_mutex;
+inline std::vector<std::unique_ptr<Buffer>> registry;
+
+inline uint64_t now()
+{
+	static const auto epoch = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		   std::chrono::steady_clock::now() - epoch)
+	    .count();
+}
+
+// Hands the buffer back when its thread exits
+struct Owner {
+	Buffer *buffer = nullptr;
+
+	~Owner()
+	{
+		if (this->buffer) {
+			std::lock_guard<std::mutex> lock(registry_mutex);
+			this->buffer->owned = false;
+		}
+	}
+};
+
+inline Buffer &local()
+{
+	thread_local Owner owner;
+	if (!owner.buffer) {
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		for (auto &buffer : registry) {
+			if (!buffer->owned) {
+				buffer->owned = true;
+				owner.buffer = buffer.get();
+				break;
+			}
+		}
+		if (!owner.buffer) {
+			registry.push_back(std::make_unique<Buffer>());
+			registry.back()->tid = registry.size();
+			owner.buffer = registry.back().get();
+		}
+	}
+	return *owner.buffer;
+}
+
+inline void begin(const char *name) { local().push(name, 'B', now()); }
+inline void end() { local().push(nullptr, 'E', now()); }
+
+class Scope
+{
+      public:
+	explicit Scope(const char *name) { begin(name); }
+	~Scope() { end(); }
+	Scope(const Scope &) = delete;
+	Scope &operator=(const Scope &) = delete;
+};
+
+// Writes every thread's events as Chrome trace-event JSON
+inline void write(std::ostream &out)
+{
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	bool first = true;
+	for (auto &buffer : registry) {
+		out << (first ? "" : ",") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		    << "\"tid\":" << buffer->tid << ",\"args\":{\"name\":\"" << buffer->name.load()
+		    << "\"}}";
+		first = false;
+
+		// The thread may be recording while we read, so events it writes over on the
+		// way are left out
+		auto head = buffer->head.load(std::memory_order_acquire);
+		auto from = head > Buffer::capacity ? head - Buffer::capacity : 0;
+		std::vector<Event> events;
+		for (auto i = from; i < head; ++i) {
+			Event event;
+			if (buffer->read(i, event)) {
+				events.push_back(event);
+			}
+		}
+
+		for (const auto &event : events) {
+			out << ",{\"ph\":\"" << event.phase << "\",\"pid\":1,\"tid\":" << buffer->tid
+			    << ",\"ts\":" << event.time / 1000 << "." << event.time / 100 % 10;
+			if (event.name) {
+				out << ",\"name\":\"" << event.name << "\"";
+			}
+			out << "}";
+		}
+	}
+	out << "]}\n";
+}
+
+// Saves the trace to `path`. In the browser, where there is nowhere to save it, the trace
+// is offered as a download under that name instead.
+inline void dump(const std::string &path)
+{
+#ifdef __EMSCRIPTEN__
+	std::ostringstream out;
+	write(out);
+	auto json = out.str();
+	EM_ASM(
+	    {
+		    var blob = new Blob([HEAPU8.subarray($0, $0 + $1)], {type : 'application/json'});
+		    var link = document.createElement('a');
+		    link.href = URL.createObjectURL(blob);
+		    link.download = UTF8ToString($2);
+		    link.click();
+		    URL.revokeObjectURL(link.href);
+	    },
+	    json.data(), json.size(), path.c_str());
+#else
+	std::ofstream out(path);
+	write(out);
+#endif
+}
+
+} // namespace trace
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_BEGIN(name) trace::begin(name)
+#define TRACE_END() trace::end()
+#define TRACE_THREAD(thread_name) (trace::local().name = (thread_name))
+
+#else
+
+namespace trace
+{
+const bool enabled = false;
+inline void dump(const std::string &) {}
+} // namespace trace
+
+#define TRACE_SCOPE(name)
+#define TRACE_BEGIN(name)
+#define TRACE_END()
+#define TRACE_THREAD(thread_name)
+
+#endif
+
+#endif